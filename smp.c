@@ -1,14 +1,191 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <sndfile.h>
 #include <sndio.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#define BUF_FRAMES 4096     /* frames per read/write burst             */
-#define BPS        2        /* 16-bit signed little-endian PCM (s16le) */
+#define BUF_FRAMES 4096     /* fallback frames per burst (see -b)      */
+#define PRE_FRAMES (BUF_FRAMES * 8) /* preroll decoded ahead per track */
+#define BPS        2        /* bytes per sample of 16-bit PCM (s16le)  */
+
+#define RING_SLOTS 4        /* decoded bursts buffered ahead of device */
+
+/* One playback stream, kept open across tracks for gapless playback  */
+static struct sio_hdl *out_hdl;
+static int out_rate;
+static int out_ch;
+
+/* Fan-out (-d, repeatable): decode once and feed the same bursts to
+ * several sndio devices for synchronized multi-room playback.  The
+ * first device is the primary — it provides the clock, the position
+ * accounting and the blocking backpressure — and the rest are
+ * secondaries written non-blockingly, so one slow room can never
+ * stall the others.                                                    */
+#define OUT_MAXDEV 8
+static const char *out_name[OUT_MAXDEV]; /* [0] = primary; none = default */
+static int out_ndev;
+
+struct secdev {
+    const char     *name;
+    struct sio_hdl *hdl;    /* NULL once the device has been dropped   */
+};
+static struct secdev out_sec[OUT_MAXDEV];
+static int out_nsec;
+
+/* Stream precision, negotiated with the device.  High-resolution
+ * material (24-bit, 32-bit, float) asks for s32 and decodes with
+ * sf_readf_int, so samples reach the device at full precision with
+ * exactly one conversion (libsndfile's) instead of a decode-side
+ * dither to 16 bits plus whatever the DAC path does.  If the device
+ * only takes 16 bits, everything falls back to the s16 path.           */
+static int out_bits = 16;   /* 16 or 32                                */
+static int out_bps  = BPS;  /* bytes per sample, out_bits / 8          */
+
+/* Frames per burst: -b on the command line, else negotiated from the
+ * device block size (par.round) so sio_write() never goes partial.    */
+static sf_count_t opt_burst;    /* requested with -b, 0 = auto         */
+static sf_count_t out_burst = BUF_FRAMES; /* in effect for the stream  */
+
+/* Benchmark mode (-n): run the full decode/pipeline/ring path but
+ * discard frames instead of writing to the device, and report the
+ * realtime multiple per track and in total, so decode throughput can
+ * be regression-tested without a sound card.                           */
+static int    opt_null;     /* -n                                      */
+static int    opt_mix;      /* -m, mixing engine (see play_mix)        */
+static int    out_up;       /* stream (or null sink) configured        */
+static double bench_audio;  /* seconds of audio decoded                */
+static double bench_wall;   /* wall-clock seconds spent                */
+
+/* Device position accounting (sio_onmove fires inside the sndio calls
+ * made by the writer thread, so these need no locking).  With
+ * par.xrun = SIO_SYNC the position keeps advancing through a stall,
+ * so moved > written means the device played silence we never fed it. */
+static long long out_written;   /* frames handed to the device         */
+static long long out_moved;     /* device position reported by sndio   */
+static long long xruns;         /* underrun episodes, all streams      */
+static long long xrun_frames;   /* frames of inserted silence          */
+
+static void
+out_onmove(void *arg, int delta)
+{
+    (void)arg;
+
+    out_moved += delta;
+    if (out_moved > out_written) {
+        xruns++;
+        xrun_frames += out_moved - out_written;
+        out_written = out_moved;    /* one stall counts once           */
+    }
+}
+
+/* Set from the control thread to abort the track being decoded       */
+static volatile sig_atomic_t stop_req;
+
+/* Constrained-memory mode (-B mb): small players cannot afford the
+ * default buffering, so a budget caps the resident decode/pipeline
+ * footprint — preroll shrinks, the loop and mmap caches admit only
+ * what fits their shares, the arena stops retaining oversized blocks,
+ * and drop-behind page-cache advice turns on.  Every owner of a big
+ * buffer accounts it here, and the high-water mark is reported in the
+ * -S stats so the budget can be verified in the field.                 */
+static size_t opt_budget;   /* -B, bytes; 0 = unlimited                */
+static size_t mem_used;     /* accounted buffer bytes live right now   */
+static size_t mem_hw;       /* high-water mark of the above            */
+static pthread_mutex_t mem_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+mem_acct(long long n)
+{
+    pthread_mutex_lock(&mem_mtx);
+    mem_used = (size_t)((long long)mem_used + n);
+    if (mem_used > mem_hw)
+        mem_hw = mem_used;
+    pthread_mutex_unlock(&mem_mtx);
+}
+
+/* Playback statistics (-S): per-read latency histogram, writer stall
+ * time and underruns, emitted as one machine-readable line per track
+ * and an aggregate at exit, for fleet telemetry.                       */
+static int opt_stats;       /* -S                                      */
+
+struct pstats {
+    long long read_calls;
+    uint64_t  read_ns;
+    uint64_t  read_max_ns;
+    long long hist[5];      /* <0.1ms <1ms <10ms <100ms >=100ms        */
+    long long frames;       /* input frames decoded                    */
+    long long bytes;        /* input PCM bytes produced                */
+};
+static struct pstats agg;   /* totals across all tracks                */
+static long long agg_tracks;
+static uint64_t  stall_ns;  /* writer time blocked in poll()           */
+
+static uint64_t
+ts_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+stats_read(struct pstats *ps, uint64_t ns)
+{
+    int b = ns < 100000 ? 0 : ns < 1000000 ? 1 : ns < 10000000 ? 2 :
+            ns < 100000000 ? 3 : 4;
+
+    ps->read_calls++;
+    ps->read_ns += ns;
+    if (ns > ps->read_max_ns)
+        ps->read_max_ns = ns;
+    ps->hist[b]++;
+}
+
+static void
+stats_emit(const char *name, const struct pstats *ps, uint64_t open_ns,
+           uint64_t stall, long long xr)
+{
+    fprintf(stderr,
+        "smp-stat: path=%s open_ms=%.1f frames=%lld bytes=%lld "
+        "read_calls=%lld read_ms=%.1f read_max_ms=%.1f "
+        "read_hist=%lld/%lld/%lld/%lld/%lld stall_ms=%.1f xruns=%lld "
+        "mem_hw=%zu\n",
+        name, open_ns / 1e6, ps->frames, ps->bytes,
+        ps->read_calls, ps->read_ns / 1e6, ps->read_max_ns / 1e6,
+        ps->hist[0], ps->hist[1], ps->hist[2], ps->hist[3], ps->hist[4],
+        stall / 1e6, xr, mem_hw);
+}
+
+/* Fold one track into the aggregate                                  */
+static void
+stats_merge(const struct pstats *ps)
+{
+    agg.read_calls += ps->read_calls;
+    agg.read_ns    += ps->read_ns;
+    if (ps->read_max_ns > agg.read_max_ns)
+        agg.read_max_ns = ps->read_max_ns;
+    for (int i = 0; i < 5; i++)
+        agg.hist[i] += ps->hist[i];
+    agg.frames += ps->frames;
+    agg.bytes  += ps->bytes;
+    agg_tracks++;
+}
 
 static void
 die(const char *msg)
@@ -17,101 +194,3284 @@ die(const char *msg)
     exit(EXIT_FAILURE);
 }
 
-/* Open sndio with parameters matching the current track             */
-static struct sio_hdl *
-open_sndio(int rate, int ch)
+/* Arena-backed buffer pool for the pipeline: stage and decode buffers
+ * are carved from cacheline-aligned blocks with a bump pointer at
+ * track setup and released all at once by the reset between tracks.
+ * The newest (largest) block survives the reset, so once a geometry
+ * has been seen the steady-state path allocates nothing, and every
+ * buffer the resampler/mixdown loops touch is SIMD-aligned.            */
+#define ARENA_ALIGN 64
+#define ARENA_MINSZ (256 * 1024)
+
+struct ablock {
+    struct ablock *next;
+    size_t         size;
+    size_t         off;
+    uint8_t       *data;    /* ARENA_ALIGN-aligned                     */
+};
+
+static struct ablock *ar_cur;
+
+static void *
+arena_get(size_t n)
+{
+    struct ablock *b = ar_cur;
+
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (!b || b->off + n > b->size) {
+        size_t sz = b && b->size * 2 > n ? b->size * 2 : n;
+
+        if (sz < ARENA_MINSZ)
+            sz = ARENA_MINSZ;
+        b = malloc(sizeof *b);
+        if (!b)
+            die("malloc");
+        if (posix_memalign((void **)&b->data, ARENA_ALIGN, sz))
+            die("posix_memalign");
+        mem_acct(sz);
+        b->size = sz;
+        b->off  = 0;
+        b->next = ar_cur;
+        ar_cur  = b;
+    }
+
+    void *p = b->data + b->off;
+    b->off += n;
+    return p;
+}
+
+/* Drop everything handed out since the previous reset                */
+static void
+arena_reset(void)
+{
+    struct ablock *b, *next;
+
+    if (!ar_cur)
+        return;
+    for (b = ar_cur->next; b; b = next) {
+        next = b->next;
+        mem_acct(-(long long)b->size);
+        free(b->data);
+        free(b);
+    }
+    ar_cur->next = NULL;
+    ar_cur->off  = 0;
+
+    /* under a budget, don't retain a block bigger than our share      */
+    if (opt_budget && ar_cur->size > opt_budget / 4) {
+        mem_acct(-(long long)ar_cur->size);
+        free(ar_cur->data);
+        free(ar_cur);
+        ar_cur = NULL;
+    }
+}
+
+/* Ring of decoded bursts between the decoder (producer) and the
+ * writer thread (consumer), so disk/FLAC latency on one burst hides
+ * behind the device write of the previous one.  Single producer,
+ * single consumer.                                                    */
+static struct {
+    void           *pcm[RING_SLOTS];
+    sf_count_t      frames[RING_SLOTS];
+    int             head;   /* next slot the decoder fills             */
+    int             tail;   /* next slot the writer drains             */
+    int             count;
+    int             ch;     /* channels the slots were sized for       */
+    int             bps;    /* bytes per sample at allocation          */
+    sf_count_t      slot_frames; /* frames per slot at allocation      */
+    pthread_mutex_t mtx;
+    pthread_cond_t  can_put;
+    pthread_cond_t  can_get;
+} ring = {
+    .mtx     = PTHREAD_MUTEX_INITIALIZER,
+    .can_put = PTHREAD_COND_INITIALIZER,
+    .can_get = PTHREAD_COND_INITIALIZER,
+};
+
+/* Reserve the next free slot; the decoder fills it in place          */
+static void *
+ring_reserve(void)
+{
+    void *pcm;
+
+    pthread_mutex_lock(&ring.mtx);
+    while (ring.count == RING_SLOTS)
+        pthread_cond_wait(&ring.can_put, &ring.mtx);
+    pcm = ring.pcm[ring.head];
+    pthread_mutex_unlock(&ring.mtx);
+    return pcm;
+}
+
+/* Priority ducking hook: lives with the mixing engine below, but
+ * every burst passes through here on its way into the ring, so an
+ * interrupt stream can take over at the next burst boundary whatever
+ * decode path produced the music.                                      */
+static void duck_mix(void *, sf_count_t);
+static volatile int duck_on;    /* an interrupt stream is in flight    */
+
+/* Publish the reserved slot to the writer thread                     */
+static void
+ring_commit(sf_count_t frames)
+{
+    if (duck_on && ring.bps == BPS)
+        duck_mix(ring.pcm[ring.head], frames);
+    pthread_mutex_lock(&ring.mtx);
+    ring.frames[ring.head] = frames;
+    ring.head = (ring.head + 1) % RING_SLOTS;
+    ring.count++;
+    pthread_cond_signal(&ring.can_get);
+    pthread_mutex_unlock(&ring.mtx);
+}
+
+/* Wait until the writer has drained every queued burst               */
+static void
+ring_drain(void)
+{
+    pthread_mutex_lock(&ring.mtx);
+    while (ring.count > 0)
+        pthread_cond_wait(&ring.can_put, &ring.mtx);
+    pthread_mutex_unlock(&ring.mtx);
+}
+
+/* Sleep until the non-blocking stream can take more data; returns -1
+ * when the device hung up instead                                      */
+static int
+out_wait(void)
+{
+    struct pollfd pfd[sio_nfds(out_hdl)];
+    int nfds = sio_pollfd(out_hdl, pfd, POLLOUT);
+    uint64_t t0 = opt_stats ? ts_ns() : 0;
+
+    if (nfds > 0 && poll(pfd, nfds, -1) < 0)
+        die("poll");
+    if (opt_stats)
+        stall_ns += ts_ns() - t0;
+    if (sio_revents(out_hdl, pfd) & POLLHUP)
+        return -1;
+    return 0;
+}
+
+/* Write coalescing: sndiod is cheapest when every transfer is a whole
+ * number of device blocks, so the writer submits only multiples of
+ * par.round and parks the sub-block tail of odd-sized bursts (track
+ * ends, SRC output) in a carry buffer that tops up from the next
+ * burst.  The carry is flushed whenever nothing is queued behind it,
+ * so coalescing never delays the final frames of the queue.            */
+static sf_count_t wr_round;     /* device block, frames; 0 = off       */
+static sf_count_t wr_round_next;    /* pending change from a reconnect */
+static uint8_t   *wr_carry;     /* < wr_round frames awaiting a block  */
+static sf_count_t wr_carry_n;
+
+/* Hardware volume offload: for the common single-device case the -v
+ * level is handed to the server with sio_setvol(), the pipes run at
+ * unity gain, and their multiply stage bypasses itself — level
+ * control then costs nothing per sample.  Fades still ramp in
+ * software on top, which composes with the offloaded level.  When
+ * the call is refused, or with the -d fan-out where the secondaries
+ * may not honor it, the gain stays in the software stage as before.   */
+#define GAIN_UNITY (1 << 15)    /* Q15 fixed point                     */
+
+static int32_t opt_gain = GAIN_UNITY;   /* -v, Q15                     */
+static int32_t sw_gain  = GAIN_UNITY;   /* level the pipes apply       */
+
+static void
+out_setvol(void)
+{
+    sw_gain = opt_gain;
+    /* the server only attenuates: amplification (-v above 100) must
+     * stay in the software stage                                       */
+    if (opt_null || out_ndev > 1 || opt_gain >= GAIN_UNITY)
+        return;
+    if (sio_setvol(out_hdl, (unsigned int)((int64_t)opt_gain *
+                                           SIO_MAXVOL / GAIN_UNITY)))
+        sw_gain = GAIN_UNITY;
+}
+
+/* Device recovery: when sndiod goes away mid-stream, reopen with
+ * exponential backoff instead of dying.  The decoder keeps filling
+ * the ring (and blocks there once it is full), so once the device is
+ * back, playback continues from exactly where writing stopped — an
+ * sndiod blip costs the outage itself, not a process restart, a full
+ * renegotiation and a queue reseek.  Runs on the writer thread, the
+ * only toucher of the handle between ring drains.                      */
+static void
+out_recover(void)
 {
     struct sio_par par;
+    int delay = 50;         /* ms, doubling up to 2 s                  */
 
-    struct sio_hdl *hdl = sio_open(NULL, SIO_PLAY, 0);
-    if (!hdl)
-        die("sio_open");
+    fprintf(stderr, "smp: audio device lost, reconnecting\n");
+    if (out_hdl)
+        sio_close(out_hdl);
+    out_hdl = NULL;
 
-    sio_initpar(&par);
-    par.bits  = 16;
-    par.sig   = 1;          /* signed */
-    par.le    = 1;          /* little-endian */
-    par.pchan = ch;
-    par.rate  = rate;
+    for (;;) {
+        out_hdl = sio_open(out_ndev ? out_name[0] : NULL, SIO_PLAY, 1);
+        if (out_hdl) {
+            sio_initpar(&par);
+            par.bits  = out_bits;
+            par.sig   = 1;
+            par.le    = 1;
+            par.pchan = out_ch;
+            par.rate  = out_rate;
+            par.xrun  = SIO_SYNC;
 
-    if (!sio_setpar(hdl, &par) || !sio_getpar(hdl, &par))
-        die("sio_setpar");
-    if (par.bits != 16 || par.sig != 1)
-        die("device does not support 16-bit signed audio");
+            /* the stream format is fixed mid-queue: insist on it      */
+            if (sio_setpar(out_hdl, &par) && sio_getpar(out_hdl, &par) &&
+                par.bits == (unsigned int)out_bits && par.sig == 1 &&
+                par.pchan == (unsigned int)out_ch &&
+                par.rate == (unsigned int)out_rate) {
+                sio_onmove(out_hdl, out_onmove, NULL);
+                out_written = out_moved = 0;
+                if (sio_start(out_hdl))
+                    break;
+            }
+            sio_close(out_hdl);
+            out_hdl = NULL;
+        }
+        poll(NULL, 0, delay);
+        if (delay < 2000)
+            delay *= 2;
+    }
+    out_setvol();           /* re-apply an offloaded level              */
 
-    if (!sio_start(hdl))
-        die("sio_start");
+    /* The new server may use a different block size.  Only note it:
+     * we may be under an out_submit() whose source pointer is the
+     * carry itself, so the buffer must not be touched until the
+     * writer loop is between submits.                                  */
+    wr_round_next = par.round > 1 ? (sf_count_t)par.round : 0;
+    fprintf(stderr, "smp: audio device reconnected\n");
+}
 
-    return hdl;
+/* Secondary device management for the fan-out.  The stream format is
+ * already fixed by the primary negotiation, so a secondary that cannot
+ * match it exactly is skipped with a warning rather than dragging the
+ * whole stream down to its capabilities.                               */
+static void
+out_sec_close(void)
+{
+    for (int i = 0; i < out_nsec; i++)
+        if (out_sec[i].hdl)
+            sio_close(out_sec[i].hdl);
+    out_nsec = 0;
 }
 
-/* Print “Artist – Title” (or fallback to filename)                   */
 static void
-print_tags(SNDFILE *sf, const char *path)
+out_sec_open(void)
 {
-    const char *title  = sf_get_string(sf, SF_STR_TITLE);
-    const char *artist = sf_get_string(sf, SF_STR_ARTIST);
+    struct sio_par par;
 
-    if (title || artist)
-        printf("%s%s%s\n",
-               artist ? artist : "",
-               (artist && title) ? " – " : "",
-               title ? title : "");
-    else
-        printf("%s\n", path);
+    for (int i = 1; i < out_ndev; i++) {
+        struct sio_hdl *h = sio_open(out_name[i], SIO_PLAY, 1);
 
-    fflush(stdout);
+        if (h) {
+            sio_initpar(&par);
+            par.bits  = out_bits;
+            par.sig   = 1;
+            par.le    = 1;
+            par.pchan = out_ch;
+            par.rate  = out_rate;
+            par.xrun  = SIO_SYNC;
+            if (sio_setpar(h, &par) && sio_getpar(h, &par) &&
+                par.bits == (unsigned int)out_bits && par.sig == 1 &&
+                par.pchan == (unsigned int)out_ch &&
+                par.rate == (unsigned int)out_rate && sio_start(h)) {
+                out_sec[out_nsec].name = out_name[i];
+                out_sec[out_nsec].hdl  = h;
+                out_nsec++;
+                continue;
+            }
+            sio_close(h);
+        }
+        fprintf(stderr, "smp: %s: cannot open at stream format, skipped\n",
+                out_name[i]);
+    }
 }
 
-/* Play one file; returns 0 on success, non-zero on fatal error       */
-static int
-play_file(const char *path)
+static void
+out_sec_drop(int i, const char *why)
 {
-    SF_INFO info   = {0};
-    SNDFILE *sf    = sf_open(path, SFM_READ, &info);
-    if (!sf) {
-        fprintf(stderr, "%s: %s\n", path, sf_strerror(NULL));
-        return 1;
+    fprintf(stderr, "smp: %s: %s, device dropped\n", out_sec[i].name, why);
+    sio_close(out_sec[i].hdl);
+    out_sec[i].hdl = NULL;
+}
+
+/* Push frames to the device(s).  Only the primary ever blocks in
+ * poll(); the secondaries take the same bytes with non-blocking
+ * writes while the primary makes room, then get a short bounded
+ * drain.  They run off the same sample clock as the primary, so a
+ * healthy device is always caught up by then — one that is not gets
+ * dropped instead of stalling the burst behind this one.               */
+static void
+out_submit(const void *pcm, sf_count_t frames, size_t fb)
+{
+    size_t total = (size_t)frames * fb;
+    size_t done = 0;
+    size_t sdone[OUT_MAXDEV] = { 0 };
+    const uint8_t *p = pcm;
+
+    while (done < total) {
+        /* the full burst is in hand: offer it to every secondary      */
+        for (int i = 0; i < out_nsec; i++) {
+            if (!out_sec[i].hdl || sdone[i] >= total)
+                continue;
+            size_t n = sio_write(out_sec[i].hdl, p + sdone[i],
+                                 total - sdone[i]);
+            if (n == 0 && sio_eof(out_sec[i].hdl)) {
+                out_sec_drop(i, "write error");
+                continue;
+            }
+            sdone[i] += n;
+        }
+
+        size_t n = sio_write(out_hdl, p + done, total - done);
+        if (n == 0) {
+            if (sio_eof(out_hdl) || out_wait() < 0)
+                out_recover();
+            continue;
+        }
+        done += n;
+    }
+    out_written += frames;
+
+    for (int rounds = 0, idle = 0;;) {
+        struct pollfd pfd[OUT_MAXDEV * 4];
+        int nfds = 0, lag = 0, prog = 0;
+
+        for (int i = 0; i < out_nsec; i++) {
+            if (!out_sec[i].hdl || sdone[i] >= total)
+                continue;
+            size_t n = sio_write(out_sec[i].hdl, p + sdone[i],
+                                 total - sdone[i]);
+            if (n == 0 && sio_eof(out_sec[i].hdl)) {
+                out_sec_drop(i, "write error");
+                continue;
+            }
+            sdone[i] += n;
+            if (n > 0)
+                prog = 1;
+            if (sdone[i] < total) {
+                lag = 1;
+                nfds += sio_pollfd(out_sec[i].hdl, pfd + nfds, POLLOUT);
+            }
+        }
+        if (!lag)
+            break;
+        /* The grace is bounded in total, not just in progress-free
+         * rounds: a sick device trickling a token amount every poll
+         * would otherwise reset the idle count forever and pin the
+         * writer here until the primary underruns.                     */
+        idle = prog ? 0 : idle + 1;
+        if (idle >= 4 || ++rounds >= 10) {
+            for (int i = 0; i < out_nsec; i++)
+                if (out_sec[i].hdl && sdone[i] < total)
+                    out_sec_drop(i, "output stalled");
+            break;
+        }
+        if (nfds > 0 && poll(pfd, nfds, 200) < 0)
+            die("poll");
+    }
+}
+
+/* Realtime writer (-R): the writer thread owns the device deadline,
+ * so it may be elevated to SCHED_FIFO and pinned to the configured
+ * CPU, leaving decode to timeshare on the remaining cores.  Both are
+ * best-effort: without privileges (or without an affinity interface)
+ * we warn once and keep running timeshared, which is exactly what we
+ * had before.                                                          */
+static int opt_rtcpu = -1;  /* -R: writer CPU, < 0 disables            */
+
+static void
+writer_rt(void)
+{
+    struct sched_param sp;
+    int r;
+
+    if (opt_rtcpu < 0)
+        return;
+
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    if (r)
+        fprintf(stderr, "smp: writer realtime priority: %s\n",
+                strerror(r));
+
+#ifdef CPU_ZERO
+    cpu_set_t cs;
+
+    CPU_ZERO(&cs);
+    CPU_SET(opt_rtcpu, &cs);
+    r = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+    if (r)
+        fprintf(stderr, "smp: writer pin to cpu %d: %s\n",
+                opt_rtcpu, strerror(r));
+#endif
+}
+
+static void *
+writer_run(void *arg)
+{
+    (void)arg;
+
+    writer_rt();
+
+    for (;;) {
+        pthread_mutex_lock(&ring.mtx);
+        while (ring.count == 0)
+            pthread_cond_wait(&ring.can_get, &ring.mtx);
+        const uint8_t *pcm = ring.pcm[ring.tail];
+        sf_count_t frames  = ring.frames[ring.tail];
+        size_t fb          = (size_t)ring.ch * ring.bps;
+        pthread_mutex_unlock(&ring.mtx);
+
+        /* Apply a block-size change from a reconnect.  This happens
+         * here, between submits, because the failing submit that
+         * triggered the reconnect can be sourcing from the carry —
+         * swapping the buffer under it would retry freed memory.
+         * Whole blocks at the new size drain from the old carry,
+         * and the sub-block rest moves into the new one.               */
+        if (wr_round != wr_round_next) {
+            uint8_t *old = wr_carry;
+            sf_count_t keep = wr_carry_n, off = 0;
+
+            wr_round   = wr_round_next;
+            wr_carry   = NULL;
+            wr_carry_n = 0;
+            if (wr_round > 0) {
+                if (posix_memalign((void **)&wr_carry, ARENA_ALIGN,
+                                   (size_t)wr_round * fb))
+                    die("posix_memalign");
+                while (keep - off >= wr_round) {
+                    out_submit(old + off * fb, wr_round, fb);
+                    off += wr_round;
+                }
+                memcpy(wr_carry, old + off * fb,
+                       (size_t)(keep - off) * fb);
+                wr_carry_n = keep - off;
+            } else if (keep > 0) {
+                out_submit(old, keep, fb);
+            }
+            free(old);
+        }
+
+        if (opt_null) {
+            out_written += frames;
+        } else if (wr_round > 1) {
+            /* top the carry up to one whole block first               */
+            if (wr_carry_n > 0) {
+                sf_count_t need = wr_round - wr_carry_n;
+
+                if (need > frames)
+                    need = frames;
+                memcpy(wr_carry + wr_carry_n * fb, pcm,
+                       (size_t)need * fb);
+                wr_carry_n += need;
+                pcm        += need * fb;
+                frames     -= need;
+                if (wr_carry_n == wr_round) {
+                    out_submit(wr_carry, wr_round, fb);
+                    wr_carry_n = 0;
+                }
+            }
+            /* whole blocks straight from the slot, tail to the carry  */
+            sf_count_t whole = frames / wr_round * wr_round;
+
+            if (whole > 0)
+                out_submit(pcm, whole, fb);
+            if (frames > whole) {
+                memcpy(wr_carry + wr_carry_n * fb, pcm + whole * fb,
+                       (size_t)(frames - whole) * fb);
+                wr_carry_n += frames - whole;
+            }
+        } else {
+            out_submit(pcm, frames, fb);
+        }
+
+        /* Nothing queued behind this burst: flush the carry rather
+         * than hold the last frames hostage waiting for more input.   */
+        pthread_mutex_lock(&ring.mtx);
+        int last = ring.count == 1;
+        pthread_mutex_unlock(&ring.mtx);
+        if (last && wr_carry_n > 0) {
+            out_submit(wr_carry, wr_carry_n, fb);
+            wr_carry_n = 0;
+        }
+
+        pthread_mutex_lock(&ring.mtx);
+        ring.tail = (ring.tail + 1) % RING_SLOTS;
+        ring.count--;
+        pthread_cond_signal(&ring.can_put);
+        pthread_mutex_unlock(&ring.mtx);
     }
+    return NULL;
+}
+
+/* (Re)open sndio only when the track parameters actually change.
+ * Tracks sharing rate/channels keep the running stream, so the device
+ * never drains between them and transitions are sample-accurate.      */
+static void
+out_ensure(int rate, int ch, int bits)
+{
+    struct sio_par par;
+    static pthread_t writer;
+
+    if (out_up)
+        return;             /* rate and layout adapt to the stream     */
 
-    /* Print metadata                                                        */
-    print_tags(sf, path);
+    if (opt_null) {
+        /* no device: the writer discards at memory speed              */
+        out_rate  = rate;
+        out_ch    = ch;
+        out_bits  = bits;
+        out_bps   = bits / 8;
+        out_burst = opt_burst ? opt_burst : BUF_FRAMES;
+        wr_round  = wr_round_next = 0;
+        out_setvol();       /* no offload, but the pipes need sw_gain   */
+    } else {
+        /* Ask for the wanted precision; if the device won't take s32,
+         * renegotiate at 16 bits rather than fail.                     */
+        for (;;) {
+            out_hdl = sio_open(out_ndev ? out_name[0] : NULL, SIO_PLAY, 1);
+            if (!out_hdl)
+                die("sio_open");
 
-    /* Prepare sndio                                                         */
-    struct sio_hdl *hdl = open_sndio(info.samplerate, info.channels);
+            sio_initpar(&par);
+            par.bits  = bits;
+            par.sig   = 1;          /* signed */
+            par.le    = 1;          /* little-endian */
+            par.pchan = ch;
+            par.rate  = rate;
+            par.xrun  = SIO_SYNC;   /* position advances on underruns  */
 
-    /* I/O loop                                                              */
-    int16_t buf[BUF_FRAMES * info.channels];
-    sf_count_t frames;
-    while ((frames = sf_readf_short(sf, buf, BUF_FRAMES)) > 0) {
-        size_t to_write = (size_t)frames * info.channels * BPS;
-        const uint8_t *p = (const uint8_t *)buf;
+            if (!sio_setpar(out_hdl, &par) || !sio_getpar(out_hdl, &par))
+                die("sio_setpar");
+            if (par.bits == (unsigned int)bits && par.sig == 1 &&
+                (bits == 16 || par.bps == 4))
+                break;
+            if (bits == 32) {
+                sio_close(out_hdl);
+                bits = 16;
+                continue;
+            }
+            die("device does not support 16-bit signed audio");
+        }
+        out_bits = bits;
+        out_bps  = bits / 8;
+
+        sio_onmove(out_hdl, out_onmove, NULL);
+        out_written = out_moved = 0;
+
+        if (!sio_start(out_hdl))
+            die("sio_start");
+        out_setvol();
+
+        out_rate = par.rate;    /* the device may not grant these      */
+        out_ch   = par.pchan;
 
-        while (to_write > 0) {
-            ssize_t n = sio_write(hdl, p, to_write);
-            if (n == 0)
-                die("sio_write");
-            p += n;
-            to_write -= (size_t)n;
+        /* Burst size: an explicit -b is rounded up to the device
+         * block, auto mode takes the block itself, so every committed
+         * burst maps to whole device blocks and the drain loop never
+         * spins on a partial sio_write().                              */
+        out_burst = opt_burst ? opt_burst : (sf_count_t)par.round;
+        if (out_burst <= 0)
+            out_burst = BUF_FRAMES;
+        if (par.round > 0)
+            out_burst = (out_burst + par.round - 1) / par.round * par.round;
+
+        /* coalescing carry: at most one device block ever parks here  */
+        wr_round = wr_round_next = par.round > 1 ? (sf_count_t)par.round : 0;
+        if (wr_round > 0) {
+            free(wr_carry);
+            if (posix_memalign((void **)&wr_carry, ARENA_ALIGN,
+                               (size_t)wr_round * out_ch * out_bps))
+                die("posix_memalign");
+            wr_carry_n = 0;
         }
+
+        /* fan-out: bring the secondary rooms up at the same format    */
+        out_sec_close();
+        if (out_ndev > 1)
+            out_sec_open();
     }
 
-    sio_close(hdl);
-    sf_close(sf);
+    /* Resize the ring slots for the new geometry (the ring is empty
+     * here, so the writer cannot be touching them).                   */
+    if (ring.ch != out_ch || ring.bps != out_bps ||
+        ring.slot_frames != out_burst) {
+        mem_acct(RING_SLOTS * ((long long)out_burst * out_ch * out_bps -
+                 (long long)ring.slot_frames * ring.ch * ring.bps));
+        for (int i = 0; i < RING_SLOTS; i++) {
+            free(ring.pcm[i]);
+            if (posix_memalign(&ring.pcm[i], ARENA_ALIGN,
+                               (size_t)out_burst * out_ch * out_bps))
+                die("posix_memalign");
+        }
+        ring.ch = out_ch;
+        ring.bps = out_bps;
+        ring.slot_frames = out_burst;
+    }
+
+    if (!writer) {
+        if (pthread_create(&writer, NULL, writer_run, NULL))
+            die("pthread_create");
+    }
+    out_up = 1;
+}
+
+/* Queue one decoded burst for the writer thread                      */
+static void
+out_write(const void *pcm, sf_count_t frames, int ch)
+{
+    const uint8_t *p = pcm;
+    size_t fb = (size_t)ch * out_bps;
+
+    while (frames > 0) {
+        sf_count_t n = frames < out_burst ? frames : out_burst;
+        void *slot = ring_reserve();
+
+        memcpy(slot, p, (size_t)n * fb);
+        ring_commit(n);
+        p      += n * fb;
+        frames -= n;
+    }
+}
+
+/* Quiet mode (-q): skip metadata entirely.  sf_get_string() can seek
+ * back into the container, so headless players should not pay those
+ * round-trips at all.                                                  */
+static int opt_quiet;       /* -q                                      */
+
+/* Linear-interpolation sample-rate converter, so one device stream at
+ * a fixed rate can serve a playlist mixing 44.1/48 kHz material
+ * without reopening the device.  Position and step are 32.32 fixed
+ * point; the last frame of each burst is carried over so bursts join
+ * seamlessly.                                                         */
+#define SRC_MAX_CH 8
+
+struct src {
+    uint64_t pos;           /* 32.32 index into [prev, in...]          */
+    uint64_t step;          /* in_rate / out_rate, 32.32               */
+    int16_t  prev[SRC_MAX_CH]; /* final frame of the previous burst    */
+    int      primed;
+    int      ch;
+};
+
+static void
+src_init(struct src *s, int in_rate, int out_rate, int ch)
+{
+    memset(s, 0, sizeof *s);
+    s->step = ((uint64_t)in_rate << 32) / out_rate;
+    s->ch   = ch;
+}
+
+/* Convert one input burst, appending to out; consumes all of in and
+ * returns the frames produced (at most in_frames * out/in + 1).       */
+static sf_count_t
+src_run(struct src *s, const int16_t *in, sf_count_t in_frames,
+        int16_t *out)
+{
+    sf_count_t n = 0;
+    int ch = s->ch;
+
+    if (in_frames <= 0)
+        return 0;
+    if (!s->primed) {
+        memcpy(s->prev, in, ch * sizeof(int16_t));
+        s->pos = (uint64_t)1 << 32;     /* begin on the first frame    */
+        s->primed = 1;
+    }
+
+    /* Virtual input: index 0 is prev, 1..in_frames are this burst     */
+    while ((s->pos >> 32) < (uint64_t)in_frames) {
+        sf_count_t idx = s->pos >> 32;
+        uint32_t frac  = (uint32_t)s->pos;
+        const int16_t *a = idx == 0 ? s->prev : in + (idx - 1) * ch;
+        const int16_t *b = in + idx * ch;
+
+        for (int c = 0; c < ch; c++)
+            out[n * ch + c] = (int16_t)(a[c] +
+                (((int64_t)(b[c] - a[c]) * frac) >> 32));
+        n++;
+        s->pos += s->step;
+    }
+    s->pos -= (uint64_t)in_frames << 32;
+    memcpy(s->prev, in + (in_frames - 1) * ch, ch * sizeof(int16_t));
+    return n;
+}
+
+/* Adapt the channel layout of one burst to the stream's.  The common
+ * mono<->stereo cases are tight branch-free loops the compiler can
+ * vectorize; 5.1 to stereo gets a proper coefficient fold; other
+ * layouts go through a generic fold (upmix repeats source channels,
+ * downmix to mono averages, other downmixes drop the excess
+ * channels).                                                          */
+static void
+chmap_run(const int16_t *in, int16_t *out, sf_count_t frames,
+          int src_ch, int dst_ch)
+{
+    if (src_ch == 1 && dst_ch == 2) {
+        for (sf_count_t i = 0; i < frames; i++) {
+            int16_t s = in[i];
+            out[2 * i]     = s;
+            out[2 * i + 1] = s;
+        }
+    } else if (src_ch == 2 && dst_ch == 1) {
+        for (sf_count_t i = 0; i < frames; i++)
+            out[i] = (int16_t)((in[2 * i] + in[2 * i + 1]) / 2);
+    } else if (src_ch == 6 && dst_ch == 2) {
+        /* 5.1 fold-down, WAV channel order L R C LFE Ls Rs: fronts at
+         * full level, center and surrounds at -3 dB (Q15 0.707), LFE
+         * dropped as usual for small speakers.  The sum can exceed
+         * full scale, so it saturates.                                 */
+        for (sf_count_t i = 0; i < frames; i++) {
+            const int16_t *f = in + i * 6;
+            int32_t l = f[0] + ((f[2] + f[4]) * 23170 >> 15);
+            int32_t r = f[1] + ((f[2] + f[5]) * 23170 >> 15);
+
+            if (l > INT16_MAX)
+                l = INT16_MAX;
+            else if (l < INT16_MIN)
+                l = INT16_MIN;
+            if (r > INT16_MAX)
+                r = INT16_MAX;
+            else if (r < INT16_MIN)
+                r = INT16_MIN;
+            out[2 * i]     = (int16_t)l;
+            out[2 * i + 1] = (int16_t)r;
+        }
+    } else if (dst_ch == 1) {
+        for (sf_count_t i = 0; i < frames; i++) {
+            int acc = 0;
+            for (int c = 0; c < src_ch; c++)
+                acc += in[i * src_ch + c];
+            out[i] = (int16_t)(acc / src_ch);
+        }
+    } else {
+        for (sf_count_t i = 0; i < frames; i++)
+            for (int c = 0; c < dst_ch; c++)
+                out[i * dst_ch + c] =
+                    in[i * src_ch + (c < src_ch ? c : c % src_ch)];
+    }
+}
+
+/* Per-track stage pipeline between the decoder and the ring: sample-
+ * rate conversion, channel mapping, and the volume/fade stage.  The
+ * conversion stages are enabled only when the track's geometry
+ * differs from the running stream's.                                   */
+static int opt_fade_ms;     /* -F, boundary fade length                */
+
+struct pipe {
+    struct src src;
+    int        resamp;
+    int        in_ch;       /* track channels                          */
+    int16_t   *srcb;        /* SRC output                              */
+    int16_t   *mapb;        /* channel-map output                      */
+    int32_t    gain;        /* Q15; GAIN_UNITY bypasses                */
+    sf_count_t fade_in;     /* fade-in window, output frames           */
+    sf_count_t fade_out;    /* fade-out window, output frames          */
+    int        eqp;         /* equal-power fade curve (crossfades)     */
+    sf_count_t out_pos;     /* output frames produced so far           */
+    sf_count_t out_total;   /* expected total output frames, 0 unknown */
+    void     (*gkern)(void *, sf_count_t, int32_t, int); /* gain loop  */
+};
+
+/* Specialized gain kernels, one per sample width and channel layout,
+ * expanded from a single macro and selected once at pipe setup.  Each
+ * body is a flat multiply-shift-clamp over a span of known shape —
+ * no per-frame branching, a compile-time trip-count multiplier for
+ * the mono and stereo variants — so the compiler vectorizes it with
+ * saturating arithmetic.  nch 0 is the any-layout fallback that takes
+ * the channel count from its argument.                                 */
+#define GAIN_KERN(name, type, acc, lo, hi, nch)                         \
+static void                                                             \
+name(void *pcm, sf_count_t frames, int32_t g, int ch)                   \
+{                                                                       \
+    type *s = pcm;                                                      \
+    sf_count_t n = frames * ((nch) ? (nch) : ch);                       \
+                                                                        \
+    for (sf_count_t i = 0; i < n; i++) {                                \
+        acc v = ((acc)s[i] * g) >> 15;                                  \
+                                                                        \
+        if (v > (hi))                                                   \
+            v = (hi);                                                   \
+        else if (v < (lo))                                              \
+            v = (lo);                                                   \
+        s[i] = (type)v;                                                 \
+    }                                                                   \
+}
+
+/* the s16 product needs 64 bits too: -v reaches 4x unity (Q15 131072),
+ * and 32767 * 131072 overflows int32                                   */
+GAIN_KERN(gain_s16_1, int16_t, int64_t, INT16_MIN, INT16_MAX, 1)
+GAIN_KERN(gain_s16_2, int16_t, int64_t, INT16_MIN, INT16_MAX, 2)
+GAIN_KERN(gain_s16_n, int16_t, int64_t, INT16_MIN, INT16_MAX, 0)
+GAIN_KERN(gain_s32_1, int32_t, int64_t, INT32_MIN, INT32_MAX, 1)
+GAIN_KERN(gain_s32_2, int32_t, int64_t, INT32_MIN, INT32_MAX, 2)
+GAIN_KERN(gain_s32_n, int32_t, int64_t, INT32_MIN, INT32_MAX, 0)
+
+/* The kernel for the running stream, picked once per track            */
+static void (*gain_kern(void))(void *, sf_count_t, int32_t, int)
+{
+    if (out_bits == 32)
+        return out_ch == 1 ? gain_s32_1 :
+               out_ch == 2 ? gain_s32_2 : gain_s32_n;
+    return out_ch == 1 ? gain_s16_1 :
+           out_ch == 2 ? gain_s16_2 : gain_s16_n;
+}
+
+/* Integer square root, for the equal-power fade curve                 */
+static uint32_t
+isqrt32(uint32_t x)
+{
+    uint32_t r = 0, bit = 1u << 30;
+
+    while (bit > x)
+        bit >>= 2;
+    for (; bit; bit >>= 2) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+    }
+    return r;
+}
+
+/* Volume/fade stage: Q15 multiply with saturation, applied in place.
+ * Unity gain outside the fade windows is bypassed entirely.  The burst
+ * is split at the fade-window edges: everything between them takes one
+ * flat gain through the specialized kernel, and only the frames inside
+ * a window pay a per-frame factor computation.                          */
+static void
+pipe_gain(struct pipe *p, void *pcm, sf_count_t frames)
+{
+    sf_count_t pos = p->out_pos;
+    uint8_t *s = pcm;
+    size_t fb = (size_t)out_ch * out_bps;
+    int has_fo = p->fade_out && p->out_total >= p->fade_out;
+    sf_count_t fo_start = has_fo ? p->out_total - p->fade_out : 0;
+
+    p->out_pos += frames;
+    if (p->gain == GAIN_UNITY && pos >= p->fade_in &&
+        (!has_fo || p->out_pos <= fo_start))
+        return;
+
+    for (sf_count_t i = 0; i < frames; ) {
+        sf_count_t at = pos + i;
+
+        if (at >= p->fade_in && !(has_fo && at > fo_start)) {
+            /* flat span: up to the fade-out edge or the burst end     */
+            sf_count_t run = frames - i;
+
+            if (has_fo && run > fo_start + 1 - at)
+                run = fo_start + 1 - at;
+            if (p->gain != GAIN_UNITY)
+                p->gkern(s + (size_t)i * fb, run, p->gain, out_ch);
+            i += run;
+            continue;
+        }
+
+        int32_t f = GAIN_UNITY;
+
+        if (p->fade_in && at < p->fade_in)
+            f = (int32_t)((int64_t)GAIN_UNITY * at / p->fade_in);
+        if (has_fo && at > fo_start) {
+            sf_count_t rem = p->out_total - at;
+            if (rem < 0)
+                rem = 0;
+            f = (int32_t)((int64_t)f * rem / p->fade_out);
+        }
+        /* equal-power: g1 = sqrt(x), g2 = sqrt(1-x), so the summed
+         * power through a crossfade stays constant                    */
+        if (p->eqp && f > 0 && f < GAIN_UNITY)
+            f = (int32_t)isqrt32((uint32_t)f << 15);
+
+        int32_t g = f == GAIN_UNITY ? p->gain :
+                    (int32_t)(((int64_t)p->gain * f) >> 15);
+        if (g != GAIN_UNITY)
+            p->gkern(s + (size_t)i * fb, 1, g, out_ch);
+        i++;
+    }
+}
+
+/* Prepare a pipe for a track against the running stream; returns -1
+ * when the track cannot be adapted (too wide for the SRC).             */
+static int
+pipe_setup(struct pipe *p, const SF_INFO *info)
+{
+    int ch = info->channels;
+
+    memset(p, 0, sizeof *p);
+    p->in_ch  = ch;
+    p->resamp = info->samplerate != out_rate;
+    if (p->resamp && ch > SRC_MAX_CH)
+        return -1;
+    /* the conversion stages are 16-bit; a wide stream cannot adapt,
+     * so the caller reopens the device at the track's geometry        */
+    if (out_bits != 16 && (p->resamp || ch != out_ch))
+        return -1;
+
+    /* size the stage buffers for the largest single push              */
+    sf_count_t cap = PRE_FRAMES > out_burst ? PRE_FRAMES : out_burst;
+
+    if (p->resamp) {
+        src_init(&p->src, info->samplerate, out_rate, ch);
+        cap = cap * out_rate / info->samplerate + 2;
+        p->srcb = arena_get(sizeof(int16_t) * cap * ch);
+    }
+    if (ch != out_ch) {
+        p->mapb = arena_get(sizeof(int16_t) * cap * out_ch);
+    }
+
+    p->gain  = sw_gain;
+    p->gkern = gain_kern();
+    if (info->frames > 0)
+        p->out_total = p->resamp ?
+            info->frames * out_rate / info->samplerate : info->frames;
+    if (opt_fade_ms > 0)
+        p->fade_in = p->fade_out =
+            (sf_count_t)opt_fade_ms * out_rate / 1000;
     return 0;
 }
 
-int
-main(int argc, char **argv)
+/* Run one burst through the stages; *pcm is redirected to the output
+ * of the last conversion stage (and may be modified in place by the
+ * gain stage) and the new frame count returned.                        */
+static sf_count_t
+pipe_run(struct pipe *p, int16_t **pcm, sf_count_t frames)
 {
-    if (argc < 2) {
-        fprintf(stderr, "usage: %s file1 [file2 …]\n", argv[0]);
-        return EXIT_FAILURE;
+    if (p->resamp) {
+        frames = src_run(&p->src, *pcm, frames, p->srcb);
+        *pcm = p->srcb;
     }
+    if (p->in_ch != out_ch) {
+        chmap_run(*pcm, p->mapb, frames, p->in_ch, out_ch);
+        *pcm = p->mapb;
+    }
+    pipe_gain(p, *pcm, frames);
+    return frames;
+}
 
-    int rc = 0;
-    for (int i = 1; i < argc; i++)
-        rc |= play_file(argv[i]);
+static void
+pipe_push(struct pipe *p, int16_t *pcm, sf_count_t frames)
+{
+    frames = pipe_run(p, &pcm, frames);
+    out_write(pcm, frames, out_ch);
+}
+
+/* Readahead policy: tracks are read strictly sequentially, so tell
+ * the kernel at open time, and with -C release the page cache behind
+ * the read position so long playlists stop evicting everything else.
+ * posix_fadvise is guarded since not every platform provides it.      */
+#define DROP_KEEP_BYTES (1024 * 1024)   /* cache kept behind cursor    */
+
+static int opt_dropcache;   /* -C                                      */
+
+static void
+advise_open(int fd)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#else
+    (void)fd;
+#endif
+}
+
+static void
+advise_behind(int fd, off_t pos)
+{
+#ifdef POSIX_FADV_DONTNEED
+    if (pos > DROP_KEEP_BYTES)
+        posix_fadvise(fd, 0, pos - DROP_KEEP_BYTES, POSIX_FADV_DONTNEED);
+#else
+    (void)fd;
+    (void)pos;
+#endif
+}
+
+/* Seek and resume (-s, -r): -s starts the first track at an offset
+ * through the decoder's seek table instead of re-decoding from frame
+ * zero, and -r names a file where the playing path and frame are
+ * persisted periodically so an interrupted session resumes with one
+ * O(1) seek.                                                           */
+static long long  opt_start_secs = -1;  /* -s                          */
+static const char *opt_resume;          /* -r                          */
+
+/* "ss", "mm:ss" or "hh:mm:ss" to seconds; -1 on parse error          */
+static long long
+parse_time(const char *s)
+{
+    long long total = 0, cur = 0;
+    int any = 0;
+
+    for (; *s; s++) {
+        if (*s >= '0' && *s <= '9') {
+            cur = cur * 10 + (*s - '0');
+            any = 1;
+        } else if (*s == ':' && any) {
+            total = (total + cur) * 60;
+            cur = 0;
+            any = 0;
+        } else {
+            return -1;
+        }
+    }
+    return any ? total + cur : -1;
+}
+
+static void
+resume_save(const char *path, sf_count_t frame)
+{
+    FILE *f = fopen(opt_resume, "w");
+
+    if (!f)
+        return;
+    fprintf(f, "%s\n%lld\n", path, (long long)frame);
+    fclose(f);
+}
+
+/* Stored frame for path, or 0 when the file names a different track  */
+static sf_count_t
+resume_load(const char *path)
+{
+    char saved[PATH_MAX + 2];
+    long long frame = 0;
+    FILE *f = fopen(opt_resume, "r");
+
+    if (!f)
+        return 0;
+    if (fgets(saved, sizeof saved, f)) {
+        saved[strcspn(saved, "\n")] = '\0';
+        if (strcmp(saved, path) == 0 &&
+            fscanf(f, "%lld", &frame) != 1)
+            frame = 0;
+        if (strcmp(saved, path) != 0)
+            frame = 0;
+    }
+    fclose(f);
+    return frame > 0 ? (sf_count_t)frame : 0;
+}
+
+/* Memory-mapped read mode (-M): small files that are replayed often
+ * are mapped once and kept in an LRU cache keyed by path, so repeat
+ * plays serve libsndfile from memory with no syscalls on the read
+ * path.                                                               */
+#define MMAP_MAX_BYTES (1024 * 1024)    /* only map small hot files    */
+#define MMAP_SLOTS     16
+
+static int opt_mmap;        /* -M                                      */
+
+static struct {
+    char              *path;
+    uint8_t           *base;
+    size_t             size;
+    time_t             mtime;
+    unsigned long long stamp;   /* LRU clock value of the last hit     */
+    int                pins;    /* live vio readers; never evicted     */
+} map_cache[MMAP_SLOTS];
+static unsigned long long map_clock;
+static size_t             map_total;    /* mapped bytes                */
+static pthread_mutex_t map_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return a cached mapping of path, mapping and evicting as needed.
+ * The entry comes back pinned: eviction never touches a mapping a
+ * live vio is reading from, and the caller releases the pin with
+ * map_unpin() when its vio goes away.                                  */
+static const uint8_t *
+map_get(const char *path, int fd, const struct stat *st)
+{
+    int free_i = -1, lru_i = -1;
+    const uint8_t *base = NULL;
+
+    /* mappings share the budget; past their share, use the fd path    */
+    if (opt_budget && map_total + st->st_size > opt_budget / 4)
+        return NULL;
+
+    pthread_mutex_lock(&map_mtx);
+    for (int i = 0; i < MMAP_SLOTS; i++) {
+        if (!map_cache[i].path) {
+            if (free_i < 0)
+                free_i = i;
+            continue;
+        }
+        if (strcmp(map_cache[i].path, path) == 0 &&
+            map_cache[i].size == (size_t)st->st_size &&
+            map_cache[i].mtime == st->st_mtime) {
+            map_cache[i].stamp = ++map_clock;
+            map_cache[i].pins++;
+            base = map_cache[i].base;
+            goto out;
+        }
+        if (map_cache[i].pins == 0 &&
+            (lru_i < 0 || map_cache[i].stamp < map_cache[lru_i].stamp))
+            lru_i = i;
+    }
+
+    if (free_i < 0) {           /* evict the least recently used       */
+        if (lru_i < 0)          /* every slot pinned by a live reader  */
+            goto out;           /* NULL: the caller takes the fd path  */
+        free_i = lru_i;
+        munmap(map_cache[free_i].base, map_cache[free_i].size);
+        map_total -= map_cache[free_i].size;
+        mem_acct(-(long long)map_cache[free_i].size);
+        free(map_cache[free_i].path);
+        map_cache[free_i].path = NULL;
+    }
+
+    base = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        base = NULL;
+        goto out;
+    }
+    madvise((void *)base, st->st_size, MADV_WILLNEED);
+    map_cache[free_i].path  = strdup(path);
+    if (!map_cache[free_i].path)
+        die("strdup");
+    map_cache[free_i].base  = (uint8_t *)base;
+    map_cache[free_i].size  = st->st_size;
+    map_cache[free_i].mtime = st->st_mtime;
+    map_cache[free_i].stamp = ++map_clock;
+    map_cache[free_i].pins  = 1;
+    map_total += st->st_size;
+    mem_acct(st->st_size);
+out:
+    pthread_mutex_unlock(&map_mtx);
+    return base;
+}
+
+/* Release the pin taken by map_get() once the vio reading it is gone */
+static void
+map_unpin(const uint8_t *base)
+{
+    pthread_mutex_lock(&map_mtx);
+    for (int i = 0; i < MMAP_SLOTS; i++) {
+        if (map_cache[i].path && map_cache[i].base == base) {
+            map_cache[i].pins--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&map_mtx);
+}
+
+/* libsndfile virtual I/O over a mapping: pure pointer arithmetic     */
+struct vio {
+    const uint8_t *base;
+    sf_count_t     size;
+    sf_count_t     pos;
+};
+
+static sf_count_t
+vio_filelen(void *u)
+{
+    return ((struct vio *)u)->size;
+}
+
+static sf_count_t
+vio_seek(sf_count_t off, int whence, void *u)
+{
+    struct vio *v = u;
+
+    switch (whence) {
+    case SEEK_SET: v->pos = off;           break;
+    case SEEK_CUR: v->pos += off;          break;
+    case SEEK_END: v->pos = v->size + off; break;
+    }
+    if (v->pos < 0)
+        v->pos = 0;
+    if (v->pos > v->size)
+        v->pos = v->size;
+    return v->pos;
+}
+
+static sf_count_t
+vio_read(void *ptr, sf_count_t n, void *u)
+{
+    struct vio *v = u;
+
+    if (n > v->size - v->pos)
+        n = v->size - v->pos;
+    memcpy(ptr, v->base + v->pos, n);
+    v->pos += n;
+    return n;
+}
+
+static sf_count_t
+vio_write(const void *ptr, sf_count_t n, void *u)
+{
+    (void)ptr; (void)n; (void)u;
+    return 0;               /* read-only                               */
+}
+
+static sf_count_t
+vio_tell(void *u)
+{
+    return ((struct vio *)u)->pos;
+}
+
+static SF_VIRTUAL_IO map_vio = {
+    vio_filelen, vio_seek, vio_read, vio_write, vio_tell,
+};
+
+/* Loop mode (-l): the queue repeats until interrupted.  Short files
+ * are decoded once, through the full pipeline, into a retained PCM
+ * cache in stream format; every later iteration serves the device
+ * straight from that memory, so steady-state CPU for a looping
+ * ambience bed is one memcpy per burst instead of a full re-decode.
+ * The prefetch thread peeks at the cache, so it is locked like the
+ * mmap cache.                                                           */
+#define LOOP_MAX_BYTES (16 * 1024 * 1024)   /* decoded size cap        */
+#define LOOP_SLOTS     8
+
+static int opt_loop;        /* -l                                      */
+
+static struct loopent {
+    char              *path;
+    uint8_t           *pcm;     /* stream-format frames, post-pipeline */
+    sf_count_t         frames;
+    size_t             bytes;
+    int                rate, ch, bps;
+    unsigned long long stamp;   /* LRU clock value of the last hit     */
+} loop_cache[LOOP_SLOTS];
+static unsigned long long loop_clock;
+static size_t             loop_total;   /* retained PCM bytes          */
+static pthread_mutex_t loop_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static struct loopent *
+loop_lookup(const char *path)
+{
+    for (int i = 0; i < LOOP_SLOTS; i++) {
+        if (loop_cache[i].path &&
+            strcmp(loop_cache[i].path, path) == 0) {
+            loop_cache[i].stamp = ++loop_clock;
+            return &loop_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* Does the cache hold path decoded under the running stream?          */
+static int
+loop_hit(const char *path)
+{
+    int hit;
+
+    pthread_mutex_lock(&loop_mtx);
+    const struct loopent *c = loop_lookup(path);
+
+    hit = c && c->rate == out_rate && c->ch == out_ch &&
+          c->bps == out_bps;
+    pthread_mutex_unlock(&loop_mtx);
+    return hit;
+}
+
+/* Retain one decoded track, evicting the least recently served;
+ * returns -1 (ownership stays with the caller) when it does not fit
+ * the memory budget's share                                            */
+static int
+loop_put(const char *path, uint8_t *pcm, sf_count_t frames)
+{
+    size_t bytes = (size_t)frames * out_ch * out_bps;
+
+    if (opt_budget && bytes > opt_budget / 2)
+        return -1;
+
+    pthread_mutex_lock(&loop_mtx);
+
+    /* make room within the budget's share before admitting           */
+    while (opt_budget && loop_total + bytes > opt_budget / 2) {
+        struct loopent *lru = NULL;
+
+        for (int i = 0; i < LOOP_SLOTS; i++) {
+            if (loop_cache[i].path &&
+                (!lru || loop_cache[i].stamp < lru->stamp))
+                lru = &loop_cache[i];
+        }
+        if (!lru)
+            break;
+        loop_total -= lru->bytes;
+        mem_acct(-(long long)lru->bytes);
+        free(lru->path);
+        free(lru->pcm);
+        memset(lru, 0, sizeof *lru);
+    }
+
+    struct loopent *e = loop_lookup(path);
+
+    if (!e) {
+        e = &loop_cache[0];
+        for (int i = 0; i < LOOP_SLOTS; i++) {
+            if (!loop_cache[i].path) {
+                e = &loop_cache[i];
+                break;
+            }
+            if (loop_cache[i].stamp < e->stamp)
+                e = &loop_cache[i];
+        }
+    }
+    if (e->path) {
+        loop_total -= e->bytes;
+        mem_acct(-(long long)e->bytes);
+    }
+    free(e->path);
+    free(e->pcm);
+    e->path = strdup(path);
+    if (!e->path)
+        die("strdup");
+    e->pcm    = pcm;
+    e->frames = frames;
+    e->bytes  = bytes;
+    e->rate   = out_rate;
+    e->ch     = out_ch;
+    e->bps    = out_bps;
+    e->stamp  = ++loop_clock;
+    loop_total += bytes;
+    mem_acct(bytes);
+    pthread_mutex_unlock(&loop_mtx);
+    return 0;
+}
+
+/* A track prefetched on a background thread while its predecessor is
+ * still draining: opened, header-parsed, and with PRE_FRAMES frames
+ * already decoded so the transition path does no file I/O at all.     */
+struct track {
+    const char *path;
+    int         fd;         /* our descriptor; sndfile borrows it      */
+    struct vio *vio;        /* set when served from the mmap cache     */
+    SNDFILE    *sf;
+    SF_INFO     info;
+    char       *title;      /* tags, fetched off the playback path     */
+    char       *artist;
+    int         wide;       /* wants the s32 path (24-bit/float source) */
+    void       *pre;        /* decoded preroll, s32 when wide          */
+    size_t      pre_bytes;  /* allocation size, for -B accounting      */
+    sf_count_t  pre_frames;
+    int         raw;        /* s16le passthrough: pread, no sndfile    */
+    off_t       raw_off;    /* start of the WAV data chunk             */
+    off_t       raw_end;    /* end of the WAV data chunk               */
+    sf_count_t  start;      /* first frame to play (seek/resume)       */
+    int         first;      /* head of the queue: -s/-r apply          */
+    int         xfaded;     /* head already played by a crossfade      */
+    int         cached;     /* serve from the loop cache, no decoder   */
+    int         failed;
+    struct pstats st;       /* -S instrumentation                      */
+    uint64_t    open_ns;    /* open + header-parse cost                */
+};
+
+/* Print “Artist – Title” (or fallback to filename).  The strings were
+ * copied out during prefetch; nothing here touches the decoder.        */
+static void
+print_tags(const struct track *t)
+{
+    if (opt_quiet)
+        return;
+    if (t->title || t->artist)
+        printf("%s%s%s\n",
+               t->artist ? t->artist : "",
+               (t->artist && t->title) ? " – " : "",
+               t->title ? t->title : "");
+    else
+        printf("%s\n", t->path);
+
+    fflush(stdout);
+}
+
+/* Cheap container check before sf_open(): a corrupt or truncated
+ * upload otherwise costs a full libsndfile probe of every backend,
+ * and when that happens mid-queue it stalls the transition.  The
+ * sniff runs in the lookahead stage, so damaged files are reported
+ * and skipped without ever reaching the playback path.  The table
+ * lists the magics of the containers libsndfile opens for us; note
+ * that read-mode sf_open() requires SF_INFO.format == 0 for
+ * self-describing files, so the sniff is a gate, not a format hint. */
+static int
+sniff_ok(int fd, off_t size)
+{
+    uint8_t m[12];
+
+    if (size < 64)                  /* no container header fits        */
+        return 0;
+    if (pread(fd, m, sizeof(m), 0) != (ssize_t)sizeof(m))
+        return 0;
+    if (memcmp(m, "RIFF", 4) == 0 || memcmp(m, "RF64", 4) == 0)
+        return memcmp(m + 8, "WAVE", 4) == 0;
+    if (memcmp(m, "riff", 4) == 0)  /* Sony Wave64 GUID prefix         */
+        return 1;
+    if (memcmp(m, "FORM", 4) == 0)
+        return memcmp(m + 8, "AIFF", 4) == 0 ||
+               memcmp(m + 8, "AIFC", 4) == 0;
+    if (memcmp(m, "fLaC", 4) == 0 || memcmp(m, "OggS", 4) == 0 ||
+        memcmp(m, ".snd", 4) == 0 || memcmp(m, "caff", 4) == 0)
+        return 1;
+    /* MPEG audio: an ID3v2 tag or a frame sync right at the start     */
+    if (memcmp(m, "ID3", 3) == 0)
+        return 1;
+    if (m[0] == 0xff && (m[1] & 0xe0) == 0xe0)
+        return 1;
+    return 0;
+}
+
+/* Locate the data chunk of a RIFF/WAVE file so the bulk transfer can
+ * bypass libsndfile's convert/copy layer entirely.                    */
+static int
+wav_data_region(int fd, off_t *off, off_t *len)
+{
+    uint8_t hdr[12], ck[8];
+    off_t pos = 12;
+
+    if (pread(fd, hdr, 12, 0) != 12 ||
+        memcmp(hdr, "RIFF", 4) != 0 || memcmp(hdr + 8, "WAVE", 4) != 0)
+        return -1;
+
+    for (;;) {
+        if (pread(fd, ck, 8, pos) != 8)
+            return -1;
+        uint32_t sz = ck[4] | ck[5] << 8 | ck[6] << 16 |
+                      (uint32_t)ck[7] << 24;
+        if (memcmp(ck, "data", 4) == 0) {
+            *off = pos + 8;
+            *len = sz;
+            return 0;
+        }
+        pos += 8 + sz + (sz & 1);   /* chunks are word-aligned         */
+    }
+}
+
+static void *
+prefetch_run(void *arg)
+{
+    struct track *t = arg;
+    struct stat st;
+    uint64_t t0 = opt_stats ? ts_ns() : 0;
+    int fd;
+
+    /* A looping track already decoded into the PCM cache under the
+     * running stream needs no decoder at all.                          */
+    if (opt_loop && out_up && loop_hit(t->path)) {
+        t->cached = 1;
+        return NULL;
+    }
+
+    /* Validate here, off the playback path: by the time a track is
+     * handed to play_track() it is known to be a readable regular
+     * file with a parseable header and sane stream parameters.        */
+    fd = open(t->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", t->path, strerror(errno));
+        t->failed = 1;
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a regular file\n", t->path);
+        close(fd);
+        t->failed = 1;
+        return NULL;
+    }
+    if (!sniff_ok(fd, st.st_size)) {
+        fprintf(stderr, "%s: unrecognized or truncated header\n", t->path);
+        close(fd);
+        t->failed = 1;
+        return NULL;
+    }
+    advise_open(fd);
+
+    /* Small hot files: serve libsndfile from the mmap cache so repeat
+     * plays touch no descriptor at all.                                */
+    if (opt_mmap && st.st_size > 0 && st.st_size <= MMAP_MAX_BYTES) {
+        const uint8_t *base = map_get(t->path, fd, &st);
+
+        if (base) {
+            close(fd);
+            t->fd = -1;
+            t->vio = calloc(1, sizeof *t->vio);
+            if (!t->vio)
+                die("calloc");
+            t->vio->base = base;
+            t->vio->size = st.st_size;
+            t->sf = sf_open_virtual(&map_vio, SFM_READ, &t->info, t->vio);
+            if (!t->sf) {
+                fprintf(stderr, "%s: %s\n", t->path, sf_strerror(NULL));
+                map_unpin(t->vio->base);
+                free(t->vio);
+                t->vio = NULL;
+                t->failed = 1;
+                return NULL;
+            }
+            goto opened;
+        }
+    }
+
+    t->fd = fd;
+    t->sf = sf_open_fd(fd, SFM_READ, &t->info, 0);
+    if (!t->sf) {
+        fprintf(stderr, "%s: %s\n", t->path, sf_strerror(NULL));
+        close(fd);
+        t->failed = 1;
+        return NULL;
+    }
+opened:
+    if (t->info.channels < 1 || t->info.samplerate < 1) {
+        fprintf(stderr, "%s: bad stream parameters\n", t->path);
+        sf_close(t->sf);
+        t->sf = NULL;
+        if (t->fd >= 0)
+            close(t->fd);
+        if (t->vio) {
+            map_unpin(t->vio->base);
+            free(t->vio);
+            t->vio = NULL;
+        }
+        t->failed = 1;
+        return NULL;
+    }
+
+    /* s16le WAV is already device-format: stream its data chunk with
+     * pread() and skip libsndfile's per-sample copy for the bulk
+     * transfer.  (AIFF PCM is big-endian, so no passthrough there.)   */
+    if (t->fd >= 0 &&
+        (t->info.format & SF_FORMAT_TYPEMASK) == SF_FORMAT_WAV &&
+        (t->info.format & SF_FORMAT_SUBMASK) == SF_FORMAT_PCM_16 &&
+        wav_data_region(t->fd, &t->raw_off, &t->raw_end) == 0) {
+        t->raw_end += t->raw_off;
+        t->raw = 1;
+    }
+
+    /* Start offset: a seek-table jump here replaces re-decoding the
+     * whole prefix when resuming long material.                        */
+    if (t->first) {
+        if (opt_start_secs > 0)
+            t->start = (sf_count_t)opt_start_secs * t->info.samplerate;
+        else if (opt_resume)
+            t->start = resume_load(t->path);
+        if (t->info.frames > 0 && t->start >= t->info.frames)
+            t->start = 0;
+        if (t->start > 0 && sf_seek(t->sf, t->start, SF_SEEK_SET) < 0) {
+            sf_seek(t->sf, 0, SF_SEEK_SET);
+            t->start = 0;
+        }
+    }
+
+    /* Tags are read here, off the audio thread: for some containers
+     * sf_get_string() seeks back into the file, and doing that during
+     * the transition costs synchronous metadata round-trips.           */
+    if (!opt_quiet) {
+        const char *s;
+
+        if ((s = sf_get_string(t->sf, SF_STR_TITLE)) != NULL)
+            t->title = strdup(s);
+        if ((s = sf_get_string(t->sf, SF_STR_ARTIST)) != NULL)
+            t->artist = strdup(s);
+    }
+
+    /* High-resolution sources want the s32 stream; the mixer's sum
+     * stage is 16-bit, so -m keeps everything narrow.                  */
+    if (!opt_mix) {
+        switch (t->info.format & SF_FORMAT_SUBMASK) {
+        case SF_FORMAT_PCM_24:
+        case SF_FORMAT_PCM_32:
+        case SF_FORMAT_FLOAT:
+        case SF_FORMAT_DOUBLE:
+            t->wide = 1;
+            break;
+        }
+    }
+
+    if (opt_stats)
+        t->open_ns = ts_ns() - t0;
+
+    /* A memory budget shrinks the preroll to its share               */
+    size_t ws = t->wide ? sizeof(int32_t) : sizeof(int16_t);
+    sf_count_t want = PRE_FRAMES;
+
+    if (opt_budget) {
+        sf_count_t cap = (sf_count_t)(opt_budget / 4 /
+                                      (ws * t->info.channels));
+
+        if (cap < BUF_FRAMES)
+            cap = BUF_FRAMES;
+        if (want > cap)
+            want = cap;
+    }
+    t->pre_bytes = ws * want * t->info.channels;
+    t->pre = malloc(t->pre_bytes);
+    if (!t->pre)
+        die("malloc");
+    mem_acct(t->pre_bytes);
+    if (opt_stats)
+        t0 = ts_ns();
+    t->pre_frames = t->wide ?
+        sf_readf_int(t->sf, t->pre, want) :
+        sf_readf_short(t->sf, t->pre, want);
+    if (opt_stats)
+        stats_read(&t->st, ts_ns() - t0);
+    return NULL;
+}
+
+/* Free a track's preroll, keeping the -B accounting honest           */
+static void
+track_drop_pre(struct track *t)
+{
+    free(t->pre);
+    t->pre = NULL;
+    mem_acct(-(long long)t->pre_bytes);
+    t->pre_bytes = 0;
+}
+
+/* Release a track's decoder resources (mappings stay cached)         */
+static void
+track_close(struct track *t)
+{
+    if (!t->sf)
+        return;
+    sf_close(t->sf);
+    t->sf = NULL;
+    if (t->fd >= 0)
+        close(t->fd);
+    t->fd = -1;
+    track_drop_pre(t);
+    if (t->vio) {
+        map_unpin(t->vio->base);
+        free(t->vio);
+        t->vio = NULL;
+    }
+    free(t->title);
+    t->title = NULL;
+    free(t->artist);
+    t->artist = NULL;
+}
+
+/* One decoding input feeding a sum: used by the mixing engine (-m)
+ * and by the crossfade overlap (-x).  Pulled frames go through the
+ * input's own pipe (SRC, chmap, gain/fade) and are accumulated into a
+ * 32-bit buffer; a pending span holds adapted frames the consumer has
+ * not taken yet, and any unconsumed preroll is drained first.          */
+struct mix_in {
+    struct track *t;
+    struct pipe   pipe;
+    int16_t      *in;       /* decode buffer, track layout             */
+    int16_t      *pre;      /* unconsumed preroll frames               */
+    sf_count_t    pre_n;
+    int16_t      *pend;     /* adapted frames not yet mixed            */
+    sf_count_t    pend_n;
+    sf_count_t    in_used;  /* input frames read from the file         */
+    int           done;
+};
+
+/* Accumulate up to want frames from one input; returns frames added  */
+static sf_count_t
+mix_pull(struct mix_in *m, int32_t *acc, sf_count_t want)
+{
+    sf_count_t got = 0;
+
+    while (got < want && !m->done) {
+        if (m->pend_n == 0) {
+            sf_count_t f;
+
+            if (m->pre_n > 0) {
+                f = m->pre_n < out_burst ? m->pre_n : out_burst;
+                m->pend = m->pre;
+                m->pend_n = pipe_run(&m->pipe, &m->pend, f);
+                m->pre   += f * m->pipe.in_ch;
+                m->pre_n -= f;
+                continue;
+            }
+            f = sf_readf_short(m->t->sf, m->in, out_burst);
+            if (f <= 0) {
+                m->done = 1;
+                break;
+            }
+            m->in_used += f;
+            m->pend = m->in;
+            m->pend_n = pipe_run(&m->pipe, &m->pend, f);
+            continue;
+        }
+
+        sf_count_t n = m->pend_n < want - got ? m->pend_n : want - got;
+        int32_t *dst = acc + got * out_ch;
+        for (sf_count_t i = 0; i < n * out_ch; i++)
+            dst[i] += m->pend[i];
+        m->pend   += n * out_ch;
+        m->pend_n -= n;
+        got       += n;
+    }
+    return got;
+}
+
+/* Priority ducking: the daemon's "duck <path>" command plays an
+ * announcement over the music bed.  The control thread prefetches the
+ * announcement off the playback path; duck_mix() adopts it at the
+ * next burst boundary, ramps the bed down to DUCK_GAIN with the same
+ * Q15 vector stage as the volume feature, sums the announcement in,
+ * and ramps back up when it ends.  Interrupt latency is bounded by
+ * the burst size (-b shrinks it down to par.round) plus the ring and
+ * device buffers, not by the track being decoded.                      */
+#define DUCK_GAIN    (GAIN_UNITY / 4)   /* bed level while ducked      */
+#define DUCK_RAMP_MS 50
+
+static struct track   *duck_pending;    /* handed over by ctl thread   */
+static int             player_busy;     /* a bed is being played       */
+static pthread_mutex_t duck_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void q_push(const char *);       /* daemon queue, defined below */
+
+static struct {
+    struct mix_in in;
+    struct track *t;
+    int32_t      *acc;
+    int           active;
+} duck;
+static int32_t duck_g = GAIN_UNITY;     /* current bed gain, ramping   */
+
+/* pipe_setup with heap buffers: the interrupt stream outlives the
+ * per-track arena generations                                          */
+static int
+duck_setup(struct pipe *p, const SF_INFO *info)
+{
+    int ch = info->channels;
+
+    if (out_bits != 16)
+        return -1;
+    memset(p, 0, sizeof *p);
+    p->in_ch  = ch;
+    p->resamp = info->samplerate != out_rate;
+    if (p->resamp && ch > SRC_MAX_CH)
+        return -1;
+
+    sf_count_t cap = PRE_FRAMES > out_burst ? PRE_FRAMES : out_burst;
+
+    if (p->resamp) {
+        src_init(&p->src, info->samplerate, out_rate, ch);
+        cap = cap * out_rate / info->samplerate + 2;
+        p->srcb = malloc(sizeof(int16_t) * cap * ch);
+        if (!p->srcb)
+            die("malloc");
+    }
+    if (ch != out_ch) {
+        p->mapb = malloc(sizeof(int16_t) * cap * out_ch);
+        if (!p->mapb)
+            die("malloc");
+    }
+    p->gain  = GAIN_UNITY;  /* announcements play at full level        */
+    p->gkern = gain_kern();
+    return 0;
+}
+
+static void
+duck_mix(void *pcm, sf_count_t frames)
+{
+    int16_t *s = pcm;
+
+    /* adopt a newly queued announcement at this burst boundary        */
+    if (!duck.active) {
+        struct track *t;
+
+        pthread_mutex_lock(&duck_mtx);
+        t = duck_pending;
+        duck_pending = NULL;
+        pthread_mutex_unlock(&duck_mtx);
+
+        if (t) {
+            memset(&duck.in, 0, sizeof duck.in);
+            duck.in.t = t;
+            if (duck_setup(&duck.in.pipe, &t->info) < 0) {
+                fprintf(stderr, "%s: cannot adapt to the stream\n",
+                        t->path);
+                track_close(t);
+                free((char *)t->path);
+                free(t);
+            } else {
+                duck.in.in = malloc(sizeof(int16_t) * out_burst *
+                                    t->info.channels);
+                duck.acc = malloc(sizeof(int32_t) * out_burst * out_ch);
+                if (!duck.in.in || !duck.acc)
+                    die("malloc");
+                duck.in.pre   = t->pre;
+                duck.in.pre_n = t->pre_frames;
+                duck.t = t;
+                duck.active = 1;
+            }
+        }
+    }
+
+    if (!duck.active && duck_g == GAIN_UNITY) {
+        duck_on = 0;        /* ramped back up; stop intercepting       */
+        return;
+    }
+
+    sf_count_t got = 0;
+
+    if (duck.active) {
+        memset(duck.acc, 0, sizeof(int32_t) * frames * out_ch);
+        got = mix_pull(&duck.in, duck.acc, frames);
+    }
+
+    int32_t tgt  = duck.active ? DUCK_GAIN : GAIN_UNITY;
+    int32_t step = GAIN_UNITY /
+                   ((int32_t)out_rate * DUCK_RAMP_MS / 1000 + 1);
+
+    if (step < 1)
+        step = 1;
+    for (sf_count_t i = 0; i < frames; i++) {
+        if (duck_g < tgt) {
+            duck_g += step;
+            if (duck_g > tgt)
+                duck_g = tgt;
+        } else if (duck_g > tgt) {
+            duck_g -= step;
+            if (duck_g < tgt)
+                duck_g = tgt;
+        }
+        for (int c = 0; c < out_ch; c++) {
+            int32_t v = (s[i * out_ch + c] * duck_g) >> 15;
+
+            if (i < got)
+                v += duck.acc[i * out_ch + c];
+            if (v > INT16_MAX)
+                v = INT16_MAX;
+            else if (v < INT16_MIN)
+                v = INT16_MIN;
+            s[i * out_ch + c] = (int16_t)v;
+        }
+    }
+
+    /* announcement finished: release it and let the bed ramp back    */
+    if (duck.active && duck.in.done) {
+        free(duck.in.pipe.srcb);
+        free(duck.in.pipe.mapb);
+        free(duck.in.in);
+        free(duck.acc);
+        duck.acc = NULL;
+        track_close(duck.t);
+        free((char *)duck.t->path);
+        free(duck.t);
+        duck.t = NULL;
+        duck.active = 0;
+    }
+}
+
+/* Prefetch an announcement on the control thread; returns -1 when it
+ * cannot be played                                                     */
+static int
+duck_queue(const char *path)
+{
+    struct track *t = calloc(1, sizeof *t);
+
+    if (!t || !(t->path = strdup(path)))
+        die("malloc");
+    prefetch_run(t);
+    if (t->failed) {
+        free((char *)t->path);
+        free(t);
+        return -1;
+    }
+    /* the duck path mixes narrow; drop a wide preroll and let the
+     * stream pull s16 from the start of the file instead              */
+    if (t->wide) {
+        track_drop_pre(t);
+        t->pre_frames = 0;
+        sf_seek(t->sf, 0, SF_SEEK_SET);
+        t->wide = 0;
+    }
+
+    pthread_mutex_lock(&duck_mtx);
+    if (!player_busy) {
+        /* No bed to duck: hand the path to the idle player and let
+         * the announcement play standalone right away, instead of
+         * parking it until some future track commits a burst.          */
+        pthread_mutex_unlock(&duck_mtx);
+        track_close(t);
+        free((char *)t->path);
+        free(t);
+        q_push(path);
+        return 0;
+    }
+    if (out_bits != 16) {
+        /* the mix stage is s16; a wide bed cannot be ducked           */
+        pthread_mutex_unlock(&duck_mtx);
+        track_close(t);
+        free((char *)t->path);
+        free(t);
+        return -1;
+    }
+    if (duck_pending) {     /* superseded before it ever played        */
+        track_close(duck_pending);
+        free((char *)duck_pending->path);
+        free(duck_pending);
+    }
+    duck_pending = t;
+    pthread_mutex_unlock(&duck_mtx);
+    duck_on = 1;
+    return 0;
+}
+
+/* Decode-cost index: playback measures what each track costs to
+ * decode — thread CPU-seconds per second of audio through the decode
+ * and pipeline — and persists it keyed by (path, mtime) in
+ * ~/.smp-cost, the same shape as the -t tag cache.  -Q queries the
+ * index for a queue without touching a decoder, so an external
+ * scheduler can do admission control against a CPU budget instead of
+ * discovering an overload by underrun.                                 */
+static int opt_costq;       /* -Q                                      */
+
+struct costent {
+    char     *path;
+    long long mtime;
+    double    cost;         /* CPU-seconds per audio-second            */
+};
+
+static struct costent *cost_idx;    /* sorted by path                  */
+static int             cost_n, cost_loaded;
+
+static uint64_t
+cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+cost_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct costent *)a)->path,
+                  ((const struct costent *)b)->path);
+}
+
+static void
+cost_file(char *buf, size_t sz)
+{
+    const char *home = getenv("HOME");
+
+    buf[0] = '\0';
+    if (home != NULL)
+        snprintf(buf, sz, "%s/.smp-cost", home);
+}
+
+/* Index lines are path\tmtime\tcost                                   */
+static void
+cost_load(void)
+{
+    char file[PATH_MAX], line[PATH_MAX + 64];
+    int cap = 0;
+    FILE *f;
+
+    if (cost_loaded)
+        return;
+    cost_loaded = 1;
+    cost_file(file, sizeof file);
+    if (!file[0] || (f = fopen(file, "r")) == NULL)
+        return;
+    while (fgets(line, sizeof line, f)) {
+        char *fld[3];
+        int n = 0;
+
+        line[strcspn(line, "\n")] = '\0';
+        fld[n++] = line;
+        for (char *p = line; *p && n < 3; p++) {
+            if (*p == '\t') {
+                *p = '\0';
+                fld[n++] = p + 1;
+            }
+        }
+        if (n != 3)
+            continue;
+        if (cost_n == cap) {
+            cap = cap ? cap * 2 : 256;
+            cost_idx = realloc(cost_idx, cap * sizeof *cost_idx);
+            if (!cost_idx)
+                die("realloc");
+        }
+        struct costent *e = &cost_idx[cost_n++];
+
+        e->path = strdup(fld[0]);
+        if (!e->path)
+            die("strdup");
+        e->mtime = strtoll(fld[1], NULL, 10);
+        e->cost  = strtod(fld[2], NULL);
+    }
+    fclose(f);
+    qsort(cost_idx, cost_n, sizeof *cost_idx, cost_cmp);
+}
+
+/* Persistence is deferred and batched: a rewrite per track would be
+ * O(index) I/O per transition, and the daemon plays thousands of
+ * jingles a day.  The write goes through a temp file and rename() so
+ * concurrent readers (and other smp processes) never see a torn
+ * index.                                                               */
+#define COST_SAVE_EVERY 32
+
+static int cost_dirty;      /* updates not yet on disk                 */
+
+static void
+cost_save(void)
+{
+    char file[PATH_MAX], tmp[PATH_MAX + 8];
+    FILE *f;
+
+    if (!cost_dirty)
+        return;
+    cost_file(file, sizeof file);
+    if (!file[0])
+        return;
+    snprintf(tmp, sizeof tmp, "%s.XXXXXX", file);
+
+    int fd = mkstemp(tmp);
+
+    if (fd < 0 || (f = fdopen(fd, "w")) == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return;
+    }
+    for (int i = 0; i < cost_n; i++)
+        fprintf(f, "%s\t%lld\t%.4f\n", cost_idx[i].path,
+                cost_idx[i].mtime, cost_idx[i].cost);
+    if (fclose(f) == 0 && rename(tmp, file) == 0)
+        cost_dirty = 0;
+    else
+        unlink(tmp);
+}
+
+static struct costent *
+cost_lookup(const char *path)
+{
+    struct costent key = { .path = (char *)path };
+
+    return bsearch(&key, cost_idx, cost_n, sizeof *cost_idx, cost_cmp);
+}
+
+/* Fold one measurement in and persist it.  Plays shorter than a
+ * second are too noisy to keep, and repeat measurements of an
+ * unchanged file are averaged so the figure settles.                   */
+static void
+cost_note(const char *path, double cpu, double audio)
+{
+    struct stat st;
+
+    if (audio < 1.0 || stat(path, &st) < 0)
+        return;
+    cost_load();
+
+    double c = cpu / audio;
+    struct costent *e = cost_lookup(path);
+
+    if (e) {
+        e->cost  = e->mtime == (long long)st.st_mtime ?
+                   (e->cost + c) / 2 : c;
+        e->mtime = st.st_mtime;
+    } else {
+        cost_idx = realloc(cost_idx, (cost_n + 1) * sizeof *cost_idx);
+        if (!cost_idx)
+            die("realloc");
+
+        struct costent ne = { .mtime = st.st_mtime, .cost = c };
+
+        if ((ne.path = strdup(path)) == NULL)
+            die("strdup");
+        int i = cost_n++;
+        while (i > 0 && strcmp(cost_idx[i - 1].path, ne.path) > 0) {
+            cost_idx[i] = cost_idx[i - 1];
+            i--;
+        }
+        cost_idx[i] = ne;
+    }
+    if (++cost_dirty >= COST_SAVE_EVERY)
+        cost_save();
+}
+
+/* Crossfade length (-x): the tail of each track overlaps the head of
+ * the next under an equal-power curve, both decoders feeding the one
+ * stream.                                                              */
+static int opt_xfade_ms;    /* -x                                      */
+
+/* Play one prefetched track, overlapping its tail with next's head
+ * when crossfading; returns 0 on success                              */
+static int
+play_track(struct track *t, struct track *next)
+{
+    if (t->failed)
+        return 1;
+
+    /* Loop cache hit: the whole track is already decoded in stream
+     * format.  Eviction only ever happens on this thread, so the
+     * entry cannot go away while it is being served.                   */
+    if (t->cached) {
+        pthread_mutex_lock(&loop_mtx);
+        const struct loopent *c = loop_lookup(t->path);
+        pthread_mutex_unlock(&loop_mtx);
+
+        if (c && c->rate == out_rate && c->ch == out_ch &&
+            c->bps == out_bps) {
+            if (!opt_quiet) {
+                printf("%s\n", t->path);
+                fflush(stdout);
+            }
+            /* Push burst-sized and check stop_req like the decode
+             * loops do: a cached entry can be the whole track, and
+             * one blocking out_write() of it would leave stop/play
+             * unanswered until it drained.                             */
+            const uint8_t *p = c->pcm;
+            size_t fb = (size_t)out_ch * out_bps;
+            sf_count_t left = c->frames;
+
+            while (left > 0 && !stop_req) {
+                sf_count_t n = left < out_burst ? left : out_burst;
+
+                out_write(p, n, out_ch);
+                p    += (size_t)n * fb;
+                left -= n;
+            }
+            return 0;
+        }
+        /* the stream changed since the prefetch peeked; decode it    */
+        t->cached = 0;
+        prefetch_run(t);
+        if (t->failed)
+            return 1;
+    }
+
+    int ch = t->info.channels;
+
+    print_tags(t);
+    out_ensure(t->info.samplerate, ch, t->wide ? 32 : 16);
+
+    /* Tracks whose rate or channel layout differs from the running
+     * stream are adapted instead of forcing a device reopen.            */
+    struct pipe pipe;
+    arena_reset();          /* previous track's stage buffers die here */
+    if (pipe_setup(&pipe, &t->info) < 0) {
+        /* cannot convert; reopen at the track's own geometry instead  */
+        ring_drain();
+        if (out_hdl) {
+            sio_close(out_hdl);
+            out_hdl = NULL;
+        }
+        out_up = 0;
+        out_ensure(t->info.samplerate, ch, t->wide ? 32 : 16);
+        if (pipe_setup(&pipe, &t->info) < 0)
+            die("cannot resample more than 8 channels");
+    }
+    int adapted = pipe.resamp || ch != out_ch;
+
+    /* The preroll was decoded at the track's wished width before the
+     * device had its say; reconcile in place if they disagree.         */
+    if (t->wide && out_bits == 16) {
+        const int32_t *s = t->pre;
+        int16_t *d = t->pre;
+
+        for (sf_count_t i = 0; i < t->pre_frames * ch; i++)
+            d[i] = (int16_t)(s[i] >> 16);
+    } else if (!t->wide && out_bits == 32) {
+        int32_t *d = realloc(t->pre,
+                             sizeof(int32_t) * t->pre_frames * ch);
+
+        if (!d)
+            die("realloc");
+        mem_acct((long long)(sizeof(int32_t) * t->pre_frames * ch) -
+                 (long long)t->pre_bytes);
+        t->pre_bytes = sizeof(int32_t) * t->pre_frames * ch;
+        t->pre = d;
+        const int16_t *s = t->pre;
+        for (sf_count_t i = t->pre_frames * ch - 1; i >= 0; i--)
+            d[i] = (int32_t)s[i] << 16;
+    }
+
+    /* A start offset shortens the fade-out's idea of the track        */
+    if (pipe.out_total > 0 && t->start > 0) {
+        sf_count_t skip = pipe.resamp ?
+            t->start * out_rate / t->info.samplerate : t->start;
+        pipe.out_total = pipe.out_total > skip ? pipe.out_total - skip : 0;
+    }
+    if (t->xfaded)          /* the crossfade already ramped the head   */
+        pipe.fade_in = 0;
+
+    /* Crossfade planning: decided here so the decode loops know where
+     * to stop and hand over to the overlap.  Needs a known length, a
+     * 16-bit stream (the sum stage is s16), an adaptable next track,
+     * and a tail that starts after the preroll.                        */
+    struct pipe npipe;
+    int xf = 0;
+    sf_count_t xf_stop = (sf_count_t)1 << 62;
+
+    if (opt_xfade_ms > 0 && next && !next->failed && !next->wide &&
+        out_bits == 16 && t->info.frames > 0) {
+        sf_count_t xf_in =
+            (sf_count_t)opt_xfade_ms * t->info.samplerate / 1000;
+
+        if (t->info.frames - xf_in > t->start + t->pre_frames &&
+            pipe_setup(&npipe, &next->info) == 0) {
+            sf_count_t xf_out =
+                (sf_count_t)opt_xfade_ms * out_rate / 1000;
+
+            npipe.fade_in   = xf_out;
+            npipe.fade_out  = 0;
+            npipe.out_total = 0;
+            npipe.eqp       = 1;
+            pipe.fade_out   = xf_out;
+            pipe.eqp        = 1;
+            xf_stop = t->info.frames - xf_in;
+            xf = 1;
+        }
+    }
+
+    /* Loop capture: a short track playing under -l is decoded whole,
+     * through the pipeline, into a buffer that is retained for the
+     * next iteration and pushed to the ring from here.                 */
+    int loopcap = opt_loop && !xf && !t->xfaded && t->start == 0 &&
+                  pipe.out_total > 0 &&
+                  (pipe.out_total + 64) * out_ch * out_bps <=
+                  LOOP_MAX_BYTES;
+
+    /* Preroll first: these frames were decoded while the previous
+     * track was still playing.                                        */
+    if (!loopcap) {
+        if (adapted) {
+            pipe_push(&pipe, t->pre, t->pre_frames);
+        } else {
+            pipe_gain(&pipe, t->pre, t->pre_frames);
+            out_write(t->pre, t->pre_frames, ch);
+        }
+        track_drop_pre(t);
+    }
+
+    /* Decode straight into ring slots: while the writer drains one
+     * burst to the device, the next is read here, so a read stall up
+     * to RING_SLOTS bursts deep never reaches the device.             */
+    sf_count_t in_pos = t->start + t->pre_frames;
+    uint64_t wall0 = opt_null ? ts_ns() : 0;
+    uint64_t cpu0 = cpu_ns();
+    uint64_t stall0 = stall_ns, t0;
+    long long xr0 = xruns;
+    int bursts = 0;
+    if (loopcap) {
+        sf_count_t cap = pipe.out_total + 64, total = 0, frames;
+        size_t fb = (size_t)out_ch * out_bps;
+        uint8_t *buf = malloc((size_t)cap * fb);
+        int16_t *in = arena_get((size_t)out_burst * ch * out_bps);
+        int16_t *p;
+
+        if (!buf)
+            die("malloc");
+
+        p = t->pre;
+        frames = pipe_run(&pipe, &p, t->pre_frames);
+        if (frames > cap)
+            frames = cap;
+        memcpy(buf, p, (size_t)frames * fb);
+        total = frames;
+        track_drop_pre(t);
+
+        while (!stop_req && total < cap) {
+            t0 = opt_stats ? ts_ns() : 0;
+            frames = out_bits == 32 ?
+                sf_readf_int(t->sf, (int *)in, out_burst) :
+                sf_readf_short(t->sf, in, out_burst);
+            if (opt_stats)
+                stats_read(&t->st, ts_ns() - t0);
+            if (frames <= 0)
+                break;
+            p = in;
+            frames = pipe_run(&pipe, &p, frames);
+            if (frames > cap - total)
+                frames = cap - total;
+            memcpy(buf + total * fb, p, (size_t)frames * fb);
+            total += frames;
+        }
+
+        if (stop_req) {
+            free(buf);
+        } else {
+            out_write(buf, total, out_ch);
+            if (loop_put(t->path, buf, total) < 0)
+                free(buf);
+            in_pos = t->info.frames;
+        }
+    } else if (adapted) {
+        int16_t *in = arena_get(sizeof(int16_t) * out_burst * ch);
+        sf_count_t frames;
+
+        while (!stop_req && in_pos < xf_stop) {
+            t0 = opt_stats ? ts_ns() : 0;
+            frames = sf_readf_short(t->sf, in, out_burst);
+            if (opt_stats)
+                stats_read(&t->st, ts_ns() - t0);
+            if (frames <= 0)
+                break;
+            pipe_push(&pipe, in, frames);
+            in_pos += frames;
+            bursts++;
+            if (opt_dropcache && t->fd >= 0 && bursts % 32 == 0)
+                advise_behind(t->fd, lseek(t->fd, 0, SEEK_CUR));
+            if (opt_resume && bursts % 64 == 0)
+                resume_save(t->path, in_pos);
+        }
+    } else if (t->raw && out_bps == BPS) {
+        /* Passthrough: the data chunk is already s16le, pread it into
+         * the ring without going through libsndfile.                  */
+        size_t fb = (size_t)t->info.channels * BPS;
+        off_t off = t->raw_off + (off_t)((t->start + t->pre_frames) * fb);
+
+        while (!stop_req && off < t->raw_end && in_pos < xf_stop) {
+            int16_t *slot = ring_reserve();
+            size_t want = (size_t)out_burst * fb;
+
+            if ((off_t)want > t->raw_end - off)
+                want = t->raw_end - off;
+            t0 = opt_stats ? ts_ns() : 0;
+            ssize_t n = pread(t->fd, slot, want, off);
+            if (opt_stats)
+                stats_read(&t->st, ts_ns() - t0);
+            if (n < (ssize_t)fb) {
+                if (n < 0)
+                    fprintf(stderr, "%s: %s\n", t->path, strerror(errno));
+                break;
+            }
+            off += n;
+            pipe_gain(&pipe, slot, (sf_count_t)(n / fb));
+            ring_commit((sf_count_t)(n / fb));
+            in_pos = (off - t->raw_off) / (off_t)fb;
+            bursts++;
+            if (opt_dropcache && bursts % 32 == 0)
+                advise_behind(t->fd, off);
+            if (opt_resume && bursts % 64 == 0)
+                resume_save(t->path, (off - t->raw_off) / (off_t)fb);
+        }
+    } else {
+        sf_count_t frames;
+        while (!stop_req && in_pos < xf_stop) {
+            void *slot = ring_reserve();
+            t0 = opt_stats ? ts_ns() : 0;
+            frames = out_bits == 32 ?
+                sf_readf_int(t->sf, slot, out_burst) :
+                sf_readf_short(t->sf, slot, out_burst);
+            if (opt_stats)
+                stats_read(&t->st, ts_ns() - t0);
+            if (frames <= 0)
+                break;
+            pipe_gain(&pipe, slot, frames);
+            ring_commit(frames);
+            in_pos += frames;
+            bursts++;
+            if (opt_dropcache && bursts % 32 == 0)
+                advise_behind(t->fd, lseek(t->fd, 0, SEEK_CUR));
+            if (opt_resume && bursts % 64 == 0)
+                resume_save(t->path, in_pos);
+        }
+    }
+
+    /* Overlap: pull the tail of this track and the head of the next
+     * through their pipes (whose fade windows now carry the equal-
+     * power ramps) and sum them into the ring, so an active crossfade
+     * costs one extra decode plus one add per sample.                  */
+    if (xf && !stop_req) {
+        struct mix_in a, b;
+        int32_t *acc = arena_get(sizeof(int32_t) * out_burst * out_ch);
+
+        memset(&a, 0, sizeof a);
+        memset(&b, 0, sizeof b);
+        a.t    = t;
+        a.pipe = pipe;
+        a.in   = arena_get(sizeof(int16_t) * out_burst * ch);
+        b.t    = next;
+        b.pipe = npipe;
+        b.in   = arena_get(sizeof(int16_t) * out_burst *
+                           next->info.channels);
+        b.pre   = next->pre;
+        b.pre_n = next->pre_frames;
+
+        if (t->raw)         /* the tail decodes via libsndfile again   */
+            sf_seek(t->sf, in_pos, SF_SEEK_SET);
+
+        while (!stop_req) {
+            memset(acc, 0, sizeof(int32_t) * out_burst * out_ch);
+            sf_count_t fa = mix_pull(&a, acc, out_burst);
+
+            if (fa == 0)
+                break;
+            mix_pull(&b, acc, fa);
+
+            int16_t *slot = ring_reserve();
+            for (sf_count_t i = 0; i < fa * out_ch; i++) {
+                int32_t v = acc[i];
+
+                if (v > INT16_MAX)
+                    v = INT16_MAX;
+                else if (v < INT16_MIN)
+                    v = INT16_MIN;
+                slot[i] = (int16_t)v;
+            }
+            ring_commit(fa);
+        }
+        /* frames b pulled through its pipe but the overlap outlived   */
+        if (b.pend_n > 0 && !stop_req)
+            out_write(b.pend, b.pend_n, out_ch);
+        in_pos += a.in_used;
+
+        /* Hand the consumed head back: next's own play starts exactly
+         * where the overlap stopped, with its fade-in already done.   */
+        sf_count_t used_pre = next->pre_frames - b.pre_n;
+
+        if (b.pre_n > 0)
+            memmove(next->pre, b.pre, (size_t)b.pre_n *
+                    next->info.channels * sizeof(int16_t));
+        next->pre_frames = b.pre_n;
+        next->start += used_pre + b.in_used;
+        next->xfaded = 1;
+    }
+
+    if (opt_stats) {
+        t->st.frames = in_pos - t->start;
+        t->st.bytes  = t->st.frames * ch * out_bps;
+        stats_emit(t->path, &t->st, t->open_ns,
+                   stall_ns - stall0, xruns - xr0);
+        stats_merge(&t->st);
+    }
+
+    if (opt_null) {
+        double audio = (double)(in_pos - t->start) / t->info.samplerate;
+        double wall  = (ts_ns() - wall0) / 1e9;
+
+        fprintf(stderr, "smp-bench: %s decoded %.1fx realtime "
+                "(%.2fs audio in %.3fs)\n",
+                t->path, wall > 0 ? audio / wall : 0, audio, wall);
+        bench_audio += audio;
+        bench_wall  += wall;
+    }
+
+    /* feed the decode-cost index: one stat and a small cache rewrite  */
+    cost_note(t->path, (cpu_ns() - cpu0) / 1e9,
+              (double)(in_pos - t->start) / t->info.samplerate);
+
+    track_close(t);
+    return 0;
+}
+
+/* Multi-stream mixing engine (-m): every input plays at once into the
+ * single device stream.  Each input decodes and adapts independently,
+ * the bursts are summed into a 32-bit accumulator, and the sum is
+ * saturated to s16 in one pass before entering the ring.               */
+static int
+play_mix(struct mix_in *ins, int n)
+{
+    int32_t *acc = arena_get(sizeof(int32_t) * out_burst * out_ch);
+
+    for (;;) {
+        sf_count_t frames = 0;
+
+        memset(acc, 0, sizeof(int32_t) * out_burst * out_ch);
+        for (int i = 0; i < n; i++) {
+            sf_count_t got = mix_pull(&ins[i], acc, out_burst);
+            if (got > frames)
+                frames = got;
+        }
+        if (frames == 0)
+            break;
+
+        /* saturate the sum into a ring slot in one linear pass        */
+        int16_t *slot = ring_reserve();
+        for (sf_count_t i = 0; i < frames * out_ch; i++) {
+            int32_t v = acc[i];
+            if (v > INT16_MAX)
+                v = INT16_MAX;
+            else if (v < INT16_MIN)
+                v = INT16_MIN;
+            slot[i] = (int16_t)v;
+        }
+        ring_commit(frames);
+    }
+    return 0;
+}
+
+/* Sequential queue source: paths come from argv or, with -f, are
+ * streamed one line at a time from a playlist file (or stdin with
+ * "-"), so queue length is unbounded and memory stays flat.            */
+static FILE  *plist;        /* playlist stream, NULL = argv            */
+static char **q_argv;
+static int    q_argc, q_idx;
+
+/* Next queued path (caller frees), or NULL at the end of the queue   */
+static char *
+queue_next(void)
+{
+    if (plist) {
+        char line[PATH_MAX + 2];
+
+        while (fgets(line, sizeof line, plist)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0' || line[0] == '#')  /* m3u comments    */
+                continue;
+            char *path = strdup(line);
+            if (!path)
+                die("strdup");
+            return path;
+        }
+        return NULL;
+    }
+    if (q_idx >= q_argc)
+        return NULL;
+    char *path = strdup(q_argv[q_idx++]);
+    if (!path)
+        die("strdup");
+    return path;
+}
+
+/* Query mode (-Q): print path\tcost for the whole queue from the
+ * decode-cost index alone — "?" when a file is unmeasured or has
+ * changed since — so admission decisions never start a decoder.        */
+static int
+cost_query(void)
+{
+    char *path;
+    int rc = 0;
+
+    cost_load();
+    while ((path = queue_next()) != NULL) {
+        struct stat st;
+        const struct costent *e = cost_lookup(path);
+
+        if (e && stat(path, &st) == 0 &&
+            e->mtime == (long long)st.st_mtime) {
+            printf("%s\t%.4f\n", path, e->cost);
+        } else {
+            printf("%s\t?\n", path);
+            rc = 1;
+        }
+        free(path);
+    }
+    fflush(stdout);
+    return rc;
+}
+
+/* Metadata scanner (-t): instead of printing tags one track at a time
+ * as playback reaches them, walk the whole queue with a small thread
+ * pool, parse headers only (no decode), and emit every track's tags as
+ * one batch on stdout.  Results are cached on disk keyed by
+ * (path, mtime, size), so rescanning an unchanged library does no file
+ * opens at all — which is the difference between seconds and minutes
+ * over NFS.                                                             */
+#define SCAN_THREADS 4
+
+static int opt_scan;        /* -t                                      */
+
+struct scent {
+    char      *path;
+    long long  mtime;
+    long long  size;
+    char      *artist;
+    char      *title;
+    char      *album;
+    int        used;        /* cache entry matched by this scan        */
+};
+
+static struct scent *sc_cache;      /* on-disk cache, sorted by path   */
+static int           sc_cache_n;
+static struct scent *sc_out;        /* scan results, queue order       */
+static int           sc_n;
+static int           sc_next;       /* next index a worker claims      */
+static pthread_mutex_t sc_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+scent_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct scent *)a)->path,
+                  ((const struct scent *)b)->path);
+}
+
+/* Cache lines are path\tmtime\tsize\tartist\ttitle\talbum             */
+static void
+scan_cache_load(const char *file)
+{
+    char line[PATH_MAX + 1024];
+    int cap = 0;
+    FILE *f = fopen(file, "r");
+
+    if (!f)
+        return;
+    while (fgets(line, sizeof line, f)) {
+        char *fld[6];
+        int n = 0;
+
+        line[strcspn(line, "\n")] = '\0';
+        fld[n++] = line;
+        for (char *p = line; *p && n < 6; p++) {
+            if (*p == '\t') {
+                *p = '\0';
+                fld[n++] = p + 1;
+            }
+        }
+        if (n != 6)
+            continue;
+        if (sc_cache_n == cap) {
+            cap = cap ? cap * 2 : 256;
+            sc_cache = realloc(sc_cache, cap * sizeof *sc_cache);
+            if (!sc_cache)
+                die("realloc");
+        }
+        struct scent *e = &sc_cache[sc_cache_n++];
+
+        memset(e, 0, sizeof *e);
+        e->path   = strdup(fld[0]);
+        e->mtime  = strtoll(fld[1], NULL, 10);
+        e->size   = strtoll(fld[2], NULL, 10);
+        e->artist = strdup(fld[3]);
+        e->title  = strdup(fld[4]);
+        e->album  = strdup(fld[5]);
+        if (!e->path || !e->artist || !e->title || !e->album)
+            die("strdup");
+    }
+    fclose(f);
+    qsort(sc_cache, sc_cache_n, sizeof *sc_cache, scent_cmp);
+}
+
+/* Write scan results plus any cache entries this scan did not touch,
+ * so a partial scan never forgets the rest of the library.             */
+static void
+scan_cache_save(const char *file)
+{
+    FILE *f = fopen(file, "w");
+
+    if (!f)
+        return;
+    for (int i = 0; i < sc_n; i++) {
+        const struct scent *e = &sc_out[i];
+
+        if (e->size < 0)    /* stat or open failed; don't cache        */
+            continue;
+        fprintf(f, "%s\t%lld\t%lld\t%s\t%s\t%s\n", e->path,
+                e->mtime, e->size, e->artist, e->title, e->album);
+    }
+    for (int i = 0; i < sc_cache_n; i++) {
+        const struct scent *e = &sc_cache[i];
+
+        if (e->used)
+            continue;
+        fprintf(f, "%s\t%lld\t%lld\t%s\t%s\t%s\n", e->path,
+                e->mtime, e->size, e->artist, e->title, e->album);
+    }
+    fclose(f);
+}
+
+/* Fill one result, from the cache when (path, mtime, size) matches,
+ * else by parsing the header (sf_open reads tags; no frames decoded). */
+static void
+scan_one(struct scent *e)
+{
+    struct scent key = { .path = e->path }, *hit;
+    struct stat st;
+    SF_INFO info;
+    SNDFILE *sf;
+
+    e->size = -1;
+    e->artist = e->title = e->album = "";
+    if (stat(e->path, &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+
+    hit = bsearch(&key, sc_cache, sc_cache_n, sizeof *sc_cache,
+                  scent_cmp);
+    if (hit && hit->mtime == st.st_mtime &&
+        hit->size == (long long)st.st_size) {
+        hit->used = 1;
+        e->mtime  = hit->mtime;
+        e->size   = hit->size;
+        e->artist = hit->artist;
+        e->title  = hit->title;
+        e->album  = hit->album;
+        return;
+    }
+
+    memset(&info, 0, sizeof info);
+    sf = sf_open(e->path, SFM_READ, &info);
+    if (!sf)
+        return;
+    const char *s;
+
+    if ((s = sf_get_string(sf, SF_STR_ARTIST)) && (e->artist = strdup(s)) == NULL)
+        die("strdup");
+    if ((s = sf_get_string(sf, SF_STR_TITLE)) && (e->title = strdup(s)) == NULL)
+        die("strdup");
+    if ((s = sf_get_string(sf, SF_STR_ALBUM)) && (e->album = strdup(s)) == NULL)
+        die("strdup");
+    sf_close(sf);
+    e->mtime = st.st_mtime;
+    e->size  = st.st_size;
+}
+
+static void *
+scan_worker(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        int i;
+
+        pthread_mutex_lock(&sc_mtx);
+        i = sc_next++;
+        pthread_mutex_unlock(&sc_mtx);
+        if (i >= sc_n)
+            return NULL;
+        scan_one(&sc_out[i]);
+    }
+}
+
+static int
+scan_run(void)
+{
+    char cachef[PATH_MAX];
+    const char *home = getenv("HOME");
+    pthread_t th[SCAN_THREADS];
+    char *path;
+    int cap = 0, rc = 0;
+
+    cachef[0] = '\0';
+    if (home != NULL)
+        snprintf(cachef, sizeof cachef, "%s/.smp-tags", home);
+    if (cachef[0])
+        scan_cache_load(cachef);
+
+    while ((path = queue_next()) != NULL) {
+        if (sc_n == cap) {
+            cap = cap ? cap * 2 : 256;
+            sc_out = realloc(sc_out, cap * sizeof *sc_out);
+            if (!sc_out)
+                die("realloc");
+        }
+        memset(&sc_out[sc_n], 0, sizeof sc_out[sc_n]);
+        sc_out[sc_n++].path = path;
+    }
+
+    int nth = sc_n < SCAN_THREADS ? sc_n : SCAN_THREADS;
+
+    for (int i = 0; i < nth; i++)
+        if (pthread_create(&th[i], NULL, scan_worker, NULL))
+            die("pthread_create");
+    for (int i = 0; i < nth; i++)
+        pthread_join(th[i], NULL);
+
+    /* one batch, queue order, tab-separated for the UI to split       */
+    for (int i = 0; i < sc_n; i++) {
+        const struct scent *e = &sc_out[i];
+
+        if (e->size < 0) {
+            rc = 1;
+            continue;
+        }
+        printf("%s\t%s\t%s\t%s\n", e->path, e->artist, e->title,
+               e->album);
+    }
+    fflush(stdout);
+
+    if (cachef[0])
+        scan_cache_save(cachef);
+    return rc;
+}
+
+/* Daemon mode (-D sock): a persistent process that holds the device
+ * and libraries warm and takes play/enqueue/stop/quit commands over a
+ * unix socket, so triggering a sound is one small write instead of a
+ * process start plus device negotiation.                               */
+struct qent {
+    char        *path;
+    struct qent *next;
+};
+
+static struct qent  *q_head;
+static struct qent **q_tail = &q_head;
+static int           q_quit;
+static pthread_mutex_t q_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  q_cv  = PTHREAD_COND_INITIALIZER;
+
+static void
+q_push(const char *path)
+{
+    struct qent *e = malloc(sizeof *e);
+
+    if (!e || !(e->path = strdup(path)))
+        die("malloc");
+    e->next = NULL;
+    pthread_mutex_lock(&q_mtx);
+    *q_tail = e;
+    q_tail = &e->next;
+    pthread_cond_signal(&q_cv);
+    pthread_mutex_unlock(&q_mtx);
+}
+
+/* Block until a path is queued; NULL once the daemon is quitting     */
+static char *
+q_pop(void)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&q_mtx);
+    while (!q_head && !q_quit)
+        pthread_cond_wait(&q_cv, &q_mtx);
+    if (q_head) {
+        struct qent *e = q_head;
+
+        q_head = e->next;
+        if (!q_head)
+            q_tail = &q_head;
+        path = e->path;
+        free(e);
+        /* Handing out a path consumes any stop aimed at what came
+         * before.  Clearing here, under the queue lock, means a stop
+         * or play arriving during the upcoming prefetch is still seen
+         * by the decode loops instead of being erased after it.       */
+        stop_req = 0;
+    }
+    pthread_mutex_unlock(&q_mtx);
+    return path;
+}
+
+static void
+q_clear(void)
+{
+    pthread_mutex_lock(&q_mtx);
+    while (q_head) {
+        struct qent *e = q_head;
+
+        q_head = e->next;
+        free(e->path);
+        free(e);
+    }
+    q_tail = &q_head;
+    pthread_mutex_unlock(&q_mtx);
+}
+
+static void *
+player_run(void *arg)
+{
+    char *path;
+
+    (void)arg;
+    for (;;) {
+        /* An announcement whose bed ended before a burst boundary
+         * could adopt it would otherwise sit in duck_pending until
+         * the next track; collect it here and play it standalone.
+         * Checked under duck_mtx against duck_queue()'s busy test,
+         * so an announcement is always either adopted or collected.   */
+        struct track *a;
+
+        pthread_mutex_lock(&duck_mtx);
+        player_busy = 0;
+        a = duck_pending;
+        duck_pending = NULL;
+        if (a) {
+            player_busy = 1;
+            stop_req = 0;   /* starting it consumes any earlier stop   */
+        }
+        pthread_mutex_unlock(&duck_mtx);
+        if (a) {
+            play_track(a, NULL);
+            free((char *)a->path);
+            free(a);
+            continue;
+        }
+
+        path = q_pop();
+        if (path == NULL)
+            return NULL;
+
+        struct track t;
+
+        memset(&t, 0, sizeof t);
+        t.path = path;
+        pthread_mutex_lock(&duck_mtx);
+        player_busy = 1;
+        pthread_mutex_unlock(&duck_mtx);
+        prefetch_run(&t);
+        if (!t.failed)
+            play_track(&t, NULL);
+        free(path);
+    }
+    return NULL;
+}
+
+/* Handle one command line from a client; returns 1 on quit           */
+static int
+ctl_command(char *line, FILE *out)
+{
+    char *arg = strchr(line, ' ');
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if (arg) {
+        *arg++ = '\0';
+        if (*arg == '\0')
+            arg = NULL;
+    }
+
+    if (strcmp(line, "enqueue") == 0 && arg) {
+        q_push(arg);
+    } else if (strcmp(line, "duck") == 0 && arg) {
+        /* announcement over the bed, at the next burst boundary       */
+        if (duck_queue(arg) < 0) {
+            fprintf(out, "err cannot play announcement\n");
+            return 0;
+        }
+    } else if (strcmp(line, "play") == 0 && arg) {
+        q_clear();
+        stop_req = 1;
+        q_push(arg);
+    } else if (strcmp(line, "stop") == 0) {
+        q_clear();
+        stop_req = 1;
+    } else if (strcmp(line, "quit") == 0) {
+        fprintf(out, "ok\n");
+        return 1;
+    } else {
+        fprintf(out, "err unknown command\n");
+        return 0;
+    }
+    fprintf(out, "ok\n");
+    return 0;
+}
+
+static int
+serve(const char *sockpath, int argc, char **argv)
+{
+    struct sockaddr_un sun;
+    pthread_t player;
+    int s, done = 0;
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0)
+        die("socket");
+    memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    strlcpy(sun.sun_path, sockpath, sizeof sun.sun_path);
+    unlink(sockpath);
+    if (bind(s, (struct sockaddr *)&sun, sizeof sun) < 0)
+        die("bind");
+    if (listen(s, 5) < 0)
+        die("listen");
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < argc; i++)
+        q_push(argv[i]);
+    if (pthread_create(&player, NULL, player_run, NULL))
+        die("pthread_create");
+
+    while (!done) {
+        int c = accept(s, NULL, NULL);
+        FILE *f;
+        char line[1024];
+
+        if (c < 0) {
+            if (errno == EINTR)
+                continue;
+            die("accept");
+        }
+        f = fdopen(c, "r+");
+        if (!f) {
+            close(c);
+            continue;
+        }
+        while (fgets(line, sizeof line, f)) {
+            if ((done = ctl_command(line, f)) != 0)
+                break;
+            fflush(f);
+        }
+        fclose(f);
+    }
+
+    pthread_mutex_lock(&q_mtx);
+    q_quit = 1;
+    stop_req = 1;
+    pthread_cond_broadcast(&q_cv);
+    pthread_mutex_unlock(&q_mtx);
+    pthread_join(player, NULL);
+    close(s);
+    unlink(sockpath);
+    return 0;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: smp [-ClMQSmnqt] [-B mb] [-b frames] [-D socket]\n"
+        "           [-d device] [-F ms] [-f playlist] [-R cpu] [-r file]\n"
+        "           [-s time] [-v vol] [-x ms] [file …]\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *errstr;
+    int c;
+
+    const char *opt_sock = NULL;
+
+    while ((c = getopt(argc, argv, "B:CD:F:MQR:Slmnb:d:f:qr:s:tv:x:")) != -1) {
+        switch (c) {
+        case 'f':
+            if (strcmp(optarg, "-") == 0) {
+                plist = stdin;
+            } else {
+                plist = fopen(optarg, "r");
+                if (!plist)
+                    die(optarg);
+            }
+            break;
+        case 'r':
+            opt_resume = optarg;
+            break;
+        case 's':
+            opt_start_secs = parse_time(optarg);
+            if (opt_start_secs < 0) {
+                fprintf(stderr, "-s %s: bad time\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'F':
+            opt_fade_ms = strtonum(optarg, 1, 60000, &errstr);
+            if (errstr) {
+                fprintf(stderr, "-F %s: ms %s\n", optarg, errstr);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'v':
+            opt_gain = (int32_t)(strtonum(optarg, 0, 400, &errstr) *
+                                 GAIN_UNITY / 100);
+            if (errstr) {
+                fprintf(stderr, "-v %s: volume %s\n", optarg, errstr);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'x':
+            opt_xfade_ms = strtonum(optarg, 1, 60000, &errstr);
+            if (errstr) {
+                fprintf(stderr, "-x %s: ms %s\n", optarg, errstr);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'C':
+            opt_dropcache = 1;
+            break;
+        case 'D':
+            opt_sock = optarg;
+            break;
+        case 'M':
+            opt_mmap = 1;
+            break;
+        case 'S':
+            opt_stats = 1;
+            break;
+        case 'l':
+            opt_loop = 1;
+            break;
+        case 'q':
+            opt_quiet = 1;
+            break;
+        case 'm':
+            opt_mix = 1;
+            break;
+        case 'n':
+            opt_null = 1;
+            break;
+        case 't':
+            opt_scan = 1;
+            break;
+        case 'Q':
+            opt_costq = 1;
+            break;
+        case 'b':
+            opt_burst = strtonum(optarg, 1, 1 << 20, &errstr);
+            if (errstr) {
+                fprintf(stderr, "-b %s: frames %s\n", optarg, errstr);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'B':
+            opt_budget = (size_t)strtonum(optarg, 1, 16384, &errstr) *
+                         1024 * 1024;
+            if (errstr) {
+                fprintf(stderr, "-B %s: megabytes %s\n", optarg, errstr);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            opt_rtcpu = strtonum(optarg, 0, 1023, &errstr);
+            if (errstr) {
+                fprintf(stderr, "-R %s: cpu %s\n", optarg, errstr);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            if (out_ndev >= OUT_MAXDEV) {
+                fprintf(stderr, "-d: at most %d devices\n", OUT_MAXDEV);
+                return EXIT_FAILURE;
+            }
+            out_name[out_ndev++] = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (opt_budget)         /* a budget implies drop-behind advice     */
+        opt_dropcache = 1;
+
+    if (argc < 1 && !opt_sock && !plist)
+        usage();
+
+    int rc = 0;
+
+    if (opt_costq) {
+        q_argv = argv;
+        q_argc = argc;
+        rc = cost_query();
+    } else if (opt_scan) {
+        q_argv = argv;
+        q_argc = argc;
+        rc = scan_run();
+    } else if (opt_sock) {
+        rc = serve(opt_sock, argc, argv);
+    } else if (opt_mix) {
+        /* All inputs at once, mixed into one stream                   */
+        struct mix_in *ins = calloc(argc, sizeof *ins);
+        struct track *tks = calloc(argc, sizeof *tks);
+        int n = 0;
+
+        if (!ins || !tks)
+            die("calloc");
+        for (int i = 0; i < argc; i++) {
+            tks[n].path = argv[i];
+            ins[n].t = &tks[n];
+            prefetch_run(&tks[n]);
+            if (tks[n].failed) {
+                rc = 1;
+                continue;
+            }
+            n++;
+        }
+        if (n == 0)
+            return EXIT_FAILURE;
+
+        out_ensure(tks[0].info.samplerate, tks[0].info.channels, 16);
+        arena_reset();
+
+        int k = 0;
+        for (int i = 0; i < n; i++) {
+            struct mix_in *m = &ins[i];
+
+            print_tags(m->t);
+            if (pipe_setup(&m->pipe, &m->t->info) < 0) {
+                fprintf(stderr, "%s: cannot adapt to the stream\n",
+                        m->t->path);
+                track_close(m->t);
+                rc = 1;
+                continue;
+            }
+            /* replay from frame zero; the preroll served its purpose */
+            sf_seek(m->t->sf, 0, SF_SEEK_SET);
+            track_drop_pre(m->t);
+            m->in = arena_get(sizeof(int16_t) * out_burst *
+                              m->t->info.channels);
+            if (k != i)
+                ins[k] = *m;
+            k++;
+        }
+        if (k > 0)
+            rc |= play_mix(ins, k);
+        else
+            rc = 1;
+        for (int i = 0; i < k; i++)
+            track_close(ins[i].t);
+        free(ins);
+        free(tks);
+    } else {
+        struct track cur, next;
+        pthread_t th;
+        char *path, *npath;
+
+        q_argv = argv;
+        q_argc = argc;
+
+        /* With -l the whole queue repeats until interrupted           */
+        int pass = 0, more = 1;
+
+        while (more) {
+        q_idx = 0;
+        if (plist && pass > 0) {
+            if (plist == stdin)
+                break;      /* a pipe cannot be replayed               */
+            rewind(plist);
+        }
+
+        /* First track has nothing to overlap with; prefetch inline   */
+        path = queue_next();
+        if (!path)
+            break;
+        memset(&cur, 0, sizeof cur);
+        cur.path = path;
+        cur.first = pass == 0;  /* -s/-r apply once                    */
+        prefetch_run(&cur);
+
+        while (path) {
+            npath = queue_next();
+            if (npath) {
+                memset(&next, 0, sizeof next);
+                next.path = npath;
+                if (pthread_create(&th, NULL, prefetch_run, &next))
+                    die("pthread_create");
+            }
+
+            /* a crossfade reads from next, so its prefetch must be
+             * done before the overlap starts                          */
+            int joined = 0;
+
+            if (npath && opt_xfade_ms > 0) {
+                pthread_join(th, NULL);
+                joined = 1;
+            }
+            rc |= play_track(&cur, npath ? &next : NULL);
+            free(path);
+
+            if (npath) {
+                if (!joined)
+                    pthread_join(th, NULL);
+                cur = next;
+            }
+            path = npath;
+        }
+
+        more = opt_loop && !stop_req;
+        pass++;
+        }
+
+        /* the whole queue played out; nothing left to resume          */
+        if (opt_resume && rc == 0 && !stop_req)
+            unlink(opt_resume);
+    }
+
+    if (out_up) {
+        ring_drain();
+        if (out_hdl)
+            sio_close(out_hdl);
+        out_sec_close();
+    }
+    if (opt_null && bench_wall > 0)
+        fprintf(stderr, "smp-bench: TOTAL decoded %.1fx realtime "
+                "(%.2fs audio in %.3fs)\n",
+                bench_audio / bench_wall, bench_audio, bench_wall);
+
+    if (xruns)
+        fprintf(stderr, "smp: %lld underruns (%lld frames of silence)\n",
+                xruns, xrun_frames);
+    if (opt_stats && agg_tracks > 0) {
+        char name[32];
+
+        snprintf(name, sizeof name, "TOTAL(%lld)", agg_tracks);
+        stats_emit(name, &agg, 0, stall_ns, xruns);
+    }
+
+    cost_save();            /* flush deferred decode-cost updates       */
 
     return rc ? EXIT_FAILURE : EXIT_SUCCESS;
 }